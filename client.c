@@ -3,11 +3,16 @@
 
 #include "config.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <X11/Xlib.h>
@@ -18,115 +23,44 @@
 #include "ipc.h"
 #include "utils.h"
 
-static void fn_hex(long *, bool, int, char **);
-static void fn_int(long *, bool, int, char **);
-static void fn_bool(long *, bool, int, char **);
-static void fn_font(long *, bool, int, char **);
-static void fn_str(long *, bool, int, char **);
-static void fn_int_str(long *, bool, int, char **);
+static void x_set_font(char **);
+static void x_name_desktop(char **);
 static void usage(FILE *);
-static void fn_mask(long *, bool, int, char **);
 static void version(void);
 
 static Display* display = NULL;
 static Window root = 0;
-
-struct command {
-    const char* name;
-    enum IPCCommand cmd;
-    bool config;
-    int argc;
-    void (*handler)(long *, bool, int, char **);
-};
-
-static const struct command command_table[] = {
-    { "window_move",            IPCWindowMoveRelative,      false, 2, fn_int     },
-    { "window_move_absolute",   IPCWindowMoveAbsolute,      false, 2, fn_int     },
-    { "window_resize",          IPCWindowResizeRelative,    false, 2, fn_int     },
-    { "window_resize_absolute", IPCWindowResizeAbsolute,    false, 2, fn_int     },
-    { "window_raise",           IPCWindowRaise,             false, 0, NULL       },
-    { "window_monocle",         IPCWindowMonocle,           false, 0, NULL       },
-    { "window_close",           IPCWindowClose,             false, 0, NULL       },
-    { "window_kill",            IPCWindowKill,              false, 0, NULL       },
-    { "window_center",          IPCWindowCenter,            false, 0, NULL       },
-    { "window_below",           IPCBelow,                   false, 0, NULL       },
-    { "focus_color",            IPCFocusColor,              true,  1, fn_hex     },
-    { "unfocus_color",          IPCUnfocusColor,            true,  1, fn_hex     },
-    { "inner_focus_color",      IPCInnerFocusColor,         true,  1, fn_hex     },
-    { "inner_unfocus_color",    IPCInnerUnfocusColor,       true,  1, fn_hex     },
-    { "text_focus_color",       IPCTitleFocusColor,         true,  1, fn_hex     },
-    { "text_unfocus_color",     IPCTitleUnfocusColor,       true,  1, fn_hex     },
-    { "border_width",           IPCBorderWidth,             true,  1, fn_int     },
-    { "inner_border_width",     IPCInnerBorderWidth,        true,  1, fn_int     },
-    { "title_height",           IPCTitleHeight,             true,  1, fn_int     },
-    { "switch_workspace",       IPCSwitchWorkspace,         false, 1, fn_int     },
-    { "send_to_workspace",      IPCSendWorkspace,           false, 1, fn_int     },
-    { "fullscreen",             IPCFullscreen,              false, 0, NULL       },
-    { "fullscreen_state",       IPCFullscreenState,         false, 0, NULL       },
-    { "fullscreen_remove_dec",  IPCFullscreenRemoveDec,     true,  1, fn_bool    },
-    { "fullscreen_max",         IPCFullscreenMax,           true,  1, fn_bool    },
-    { "snap_left",              IPCSnapLeft,                false, 0, NULL       },
-    { "snap_right",             IPCSnapRight,               false, 0, NULL       },
-    { "cardinal_focus",         IPCCardinalFocus,           false, 1, fn_int     },
-    { "toggle_decorations",     IPCWindowToggleDecorations, false, 0, NULL       },
-    { "cycle_focus",            IPCCycleFocus,              false, 0, NULL       },
-    { "pointer_focus",          IPCPointerFocus,            false, 0, NULL       },
-    { "quit",                   IPCQuit,                    true,  0, NULL       },
-    { "top_gap",                IPCTopGap,                  true,  1, fn_int     },
-    { "edge_gap",               IPCEdgeGap,                 false, 4, fn_int     },
-    { "save_monitor",           IPCSaveMonitor,             false, 2, fn_int     },
-    { "smart_place",            IPCSmartPlace,              true,  1, fn_bool    },
-    { "draw_text",              IPCDrawText,                true,  1, fn_bool    },
-    { "edge_lock",              IPCEdgeLock,                true,  1, fn_bool    },
-    { "set_font",               IPCSetFont,                 false, 1, fn_font    },
-    { "json_status",            IPCJSONStatus,              true,  1, fn_bool    },
-    { "manage",                 IPCManage,                  true,  1, fn_str     },
-    { "unmanage",               IPCUnmanage,                true,  1, fn_str     },
-    { "decorate_new",           IPCDecorate,                true,  1, fn_bool    },
-    { "name_desktop",           IPCNameDesktop,             false, 2, fn_int_str },
-    { "focus_button",           IPCFocusButton,             true,  1, fn_int     },
-    { "move_button",            IPCMoveButton,              true,  1, fn_int     },
-    { "move_mask",              IPCMoveMask,                true,  1, fn_mask    },
-    { "resize_button",          IPCResizeButton,            true,  1, fn_int     },
-    { "resize_mask",            IPCResizeMask,              true,  1, fn_mask    },
-    { "pointer_interval",       IPCPointerInterval,         true,  1, fn_int     },
-    { "focus_follows_pointer",  IPCFocusFollowsPointer,     true,  1, fn_bool    },
-    { "focus_on_click",         IPCFocusOnClick,            true,  1, fn_bool    },
-    { "warp_pointer",           IPCWarpPointer,             true,  1, fn_bool    },
+static Atom client_event;
+static int sock = -1;
+static int line_number = 0; /* current line in batch mode */
+
+static const char *status_names[] = {
+    [IPCSuccess]        = "success",
+    [IPCUnknownCommand] = "unknown command",
+    [IPCBadArgument]    = "bad argument",
+    [IPCFailure]        = "command failed",
 };
 
-static void
-fn_hex(long *data, bool b, int i, char **argv)
-{
-    UNUSED(b);
-    data[i+b] = strtoul(argv[i - 1], NULL, 16);
-}
-
-static void
-fn_int(long *data, bool b, int i, char **argv)
-{
-    UNUSED(b);
-    data[i+b] = strtol(argv[i - 1], NULL, 10);
-}
-
-static void
-fn_bool(long *data, bool b, int i, char **argv)
-{
-    UNUSED(b);
-    data[i+b] = strcmp(argv[i-1], "true") == 0 ? 1 : 0;
-}
+/* Commands written to the socket whose reply has not been read yet */
+static struct {
+    const struct command *c;
+    int line;
+} pending[IPC_PIPELINE];
+static int n_pending = 0;
+
+static bool socket_connect(void);
+static int socket_read_replies(void);
+static int socket_send_command(const struct command *c, int argc, char **argv);
+static int x_send_command(const struct command *c, int argc, char **argv);
+static int x_query(const struct command *c, int argc, char **argv);
+static int send_command(const struct command *c, int argc, char **argv);
+static bool connection_open(void);
+static int connection_close(void);
+static int run_command(int argc, char **argv);
+static int run_batch(const char *path);
+static int run_subscribe(const struct command *c, int argc, char **argv);
+static void report_status(const struct command *c, int line, int status);
 
-static void
-fn_str(long *data, bool b, int i, char **argv)
-{
-    UNUSED(b);
-    // lord forgive me for I have sinned
-    if (strcmp(argv[i-1], "Dialog") == 0) data[i+b] = Dialog;
-    else if (strcmp(argv[i-1], "Toolbar") == 0) data[i+b] = Toolbar;
-    else if (strcmp(argv[i-1], "Menu") == 0) data[i+b] = Menu;
-    else if (strcmp(argv[i-1], "Splash") == 0) data[i+b] = Splash;
-    else if (strcmp(argv[i-1], "Utility") == 0) data[i+b] = Utility;
-}
 
 /* This function works by setting a new atom globally on the root
  * window called BERRY_FONT_PROPERTY which tells berry what font
@@ -135,11 +69,8 @@ fn_str(long *data, bool b, int i, char **argv)
  * berry, notifying the main program to read this value
  */
 static void
-fn_font(long *data, bool b, int i, char** argv)
+x_set_font(char** argv)
 {
-    UNUSED(b);
-    UNUSED(i);
-    UNUSED(data);
     char** font_list;
     XTextProperty font_prop;
 
@@ -158,11 +89,8 @@ fn_font(long *data, bool b, int i, char** argv)
  * and the following string to the _NET_DESKTOP_NAMES property
  */
 static void
-fn_int_str(long *data, bool b, int i, char **argv)
+x_name_desktop(char **argv)
 {
-    UNUSED(b);
-    UNUSED(data);
-    UNUSED(i);
     char *name;
     char **list;
     int idx, len;
@@ -180,36 +108,12 @@ fn_int_str(long *data, bool b, int i, char **argv)
     free(list);
 }
 
-static void
-fn_mask(long *data, bool b, int i, char **argv)
-{
-    UNUSED(b);
-    data[i+b] = 0;
-    char * mask_str = strtok( argv[i-1] , "|");
-
-    while( mask_str != NULL ) {
-        if( ! strcmp(mask_str,"shift") ) data[i+b] = data[i+b]|ShiftMask;
-        else if( !strcmp(mask_str,"lock") ) data[i+b] = data[i+b]|LockMask;
-        else if( !strcmp(mask_str,"ctrl") ) data[i+b] = data[i+b]|ControlMask;
-        else if( !strcmp(mask_str,"mod1") ) data[i+b] = data[i+b]|Mod1Mask;
-        else if( !strcmp(mask_str,"mod2") ) data[i+b] = data[i+b]|Mod2Mask;
-        else if( !strcmp(mask_str,"mod3") ) data[i+b] = data[i+b]|Mod3Mask;
-        else if( !strcmp(mask_str,"mod4") ) data[i+b] = data[i+b]|Mod4Mask;
-        else if( !strcmp(mask_str,"mod5") ) data[i+b] = data[i+b]|Mod5Mask;
-        else {
-            printf("%s is not a valid modifier", mask_str);
-            data[i+b]=0;
-            break;
-        }
-        mask_str = strtok(NULL, "|");
-    }
-}
-
 static void
 usage(FILE *out)
 {
     int rc = out == stderr ? EXIT_FAILURE : EXIT_SUCCESS;
-    fputs("Usage: berryc [-h|-v] <command> [args...]\n", out);
+    fputs("Usage: berryc [-h|-v] <command> [args...]\n"
+          "       berryc -b [file]\n", out);
     exit(rc);
 }
 
@@ -220,63 +124,391 @@ version(void)
     exit(EXIT_SUCCESS);
 }
 
+/* Connect to the socket berry listens on, see ipc_socket_path */
+static bool
+socket_connect(void)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (ipc_socket_path(addr.sun_path, sizeof addr.sun_path, NULL) < 0)
+        return false;
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return false;
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    return true;
+}
+
 static void
-send_command(const struct command *c, int argc, char **argv)
+report_status(const struct command *c, int line, int status)
+{
+    const char *msg;
+
+    msg = status >= 0 && status < (int)(sizeof status_names / sizeof status_names[0]) ?
+        status_names[status] : "connection lost";
+    if (line > 0)
+        fprintf(stderr, "berry: line %d: %s: %s\n", line, c->name, msg);
+    else
+        fprintf(stderr, "berry: %s: %s\n", c->name, msg);
+}
+
+/* Read the replies of every command written so far, printing any reply
+ * payload. Returns IPCSuccess if all of them succeeded, otherwise the
+ * first failing status.
+ */
+static int
+socket_read_replies(void)
+{
+    struct ipc_reply reply;
+    char buf[256];
+    int status = IPCSuccess;
+
+    for (int i = 0; i < n_pending; i++) {
+        if (ipc_read_all(sock, &reply, sizeof reply) < 0) {
+            report_status(pending[i].c, pending[i].line, -1);
+            n_pending = 0;
+            return IPCFailure;
+        }
+
+        if (reply.length > 0) {
+            while (reply.length > 0) {
+                size_t n = MIN(reply.length, sizeof buf);
+                if (ipc_read_all(sock, buf, n) < 0)
+                    break;
+                fwrite(buf, 1, n, stdout);
+                reply.length -= n;
+            }
+            putchar('\n');
+        }
+
+        if (reply.status != IPCSuccess) {
+            report_status(pending[i].c, pending[i].line, reply.status);
+            if (status == IPCSuccess)
+                status = reply.status;
+        }
+    }
+
+    n_pending = 0;
+    return status;
+}
+
+/* Write a single command to the socket. String arguments travel inside the
+ * frame instead of through root window properties. Replies are collected by
+ * socket_read_replies, at the latest once IPC_PIPELINE commands are in flight.
+ */
+static int
+socket_send_command(const struct command *c, int argc, char **argv)
+{
+    struct ipc_frame frame;
+    long data[5];
+    const char *str = NULL;
+    int status = IPCSuccess;
+
+    str = command_pack(c, data, argc, argv);
+    frame.length = str ? strlen(str) : 0;
+    if (frame.length > IPC_STRING_MAX) {
+        report_status(c, line_number, IPCBadArgument);
+        return IPCBadArgument;
+    }
+    for (int i = 0; i < 5; i++)
+        frame.data[i] = data[i];
+
+    if (n_pending == IPC_PIPELINE)
+        status = socket_read_replies();
+
+    if (ipc_write_all(sock, &frame, sizeof frame) < 0 ||
+        (str && ipc_write_all(sock, str, frame.length) < 0)) {
+        report_status(c, line_number, -1);
+        return IPCFailure;
+    }
+
+    pending[n_pending].c = c;
+    pending[n_pending].line = line_number;
+    n_pending++;
+
+    return status;
+}
+
+/* Ask berry to serialize a snapshot into BERRY_QUERY_REPLY on a window of
+ * our own, and print it once the PropertyNotify for it arrives.
+ */
+static int
+x_query(const struct command *c, int argc, char **argv)
 {
     XEvent ev;
-    UNUSED(argc);
+    Window w;
+    Atom reply_atom, type;
+    unsigned char *data = NULL;
+    unsigned long n, after;
+    struct pollfd pfd;
+    int format, status = IPCFailure;
 
-    display = XOpenDisplay(NULL);
+    memset(&ev, 0, sizeof ev);
+    command_pack(c, ev.xclient.data.l, argc, argv);
+    if (ev.xclient.data.l[1] == QueryLast) {
+        report_status(c, line_number, IPCBadArgument);
+        return IPCBadArgument;
+    }
 
-    if (!display)
-        return;
+    w = XCreateSimpleWindow(display, root, -1, -1, 1, 1, 0, 0, 0);
+    XSelectInput(display, w, PropertyChangeMask);
+    reply_atom = XInternAtom(display, BERRY_QUERY_REPLY, False);
 
-    root = DefaultRootWindow(display);
+    ev.xclient.type = ClientMessage;
+    ev.xclient.window = root;
+    ev.xclient.message_type = client_event;
+    ev.xclient.format = 32;
+    ev.xclient.data.l[2] = w;
+    XSendEvent(display, root, false, SubstructureRedirectMask, &ev);
+    XFlush(display);
+
+    pfd.fd = ConnectionNumber(display);
+    pfd.events = POLLIN;
+    while (status != IPCSuccess) {
+        if (!XPending(display) && poll(&pfd, 1, QUERY_TIMEOUT) <= 0)
+            break;
+        XNextEvent(display, &ev);
+        if (ev.type != PropertyNotify || ev.xproperty.atom != reply_atom ||
+            ev.xproperty.state != PropertyNewValue)
+            continue;
+
+        if (XGetWindowProperty(display, w, reply_atom, 0, 0x1fffffff, True, AnyPropertyType,
+                    &type, &format, &n, &after, &data) == Success && data) {
+            printf("%s\n", (char *)data);
+            XFree(data);
+        }
+        status = IPCSuccess;
+    }
+
+    XDestroyWindow(display, w);
+    if (status != IPCSuccess)
+        report_status(c, line_number, -1);
+    return status;
+}
+
+/* Send the command as a ClientMessage to the root window. The request is
+ * only flushed when the connection is closed.
+ */
+static int
+x_send_command(const struct command *c, int argc, char **argv)
+{
+    XEvent ev;
+
+    if (c->cmd == IPCQuery)
+        return x_query(c, argc, argv);
+
+    /* Rules and bindings are too long for a root window property round trip */
+    if (c->cmd == IPCRule || c->cmd == IPCBind) {
+        fprintf(stderr, "%s needs the berry socket\n", c->name);
+        return IPCFailure;
+    }
 
     memset(&ev, 0, sizeof ev);
     ev.xclient.type = ClientMessage;
     ev.xclient.window = root;
-    ev.xclient.message_type = XInternAtom(display, BERRY_CLIENT_EVENT, False);
+    ev.xclient.message_type = client_event;
     ev.xclient.format = 32;
 
-    /* We use the following protocol:
-     * If the given command is related to berry's config then assign it a value of
-     * IPCConfig at d[0]. Then, assign the specific config element at d[1], shifting
-     * all values up by one.
-     * Otherwise, set the IPC command at d[0] and assign arguments from 1 upwards.
-     */
-    if (c->config) {
-        ev.xclient.data.l[0] = IPCConfig;
-        ev.xclient.data.l[1] = c->cmd;
-    } else {
-        ev.xclient.data.l[0] = c->cmd;
+    /* String arguments are passed through root window properties */
+    if (c->cmd == IPCNameDesktop) {
+        x_name_desktop(argv);
+        return IPCSuccess;
     }
 
-    if (strcmp(c->name, "name_desktop") == 0) {
-        fn_int_str(ev.xclient.data.l, false, 2, argv);
+    if (c->cmd == IPCSetFont)
+        x_set_font(argv);
+    command_pack(c, ev.xclient.data.l, argc, argv);
+
+    XSendEvent(display, root, false, SubstructureRedirectMask, &ev);
+    return IPCSuccess;
+}
+
+static int
+send_command(const struct command *c, int argc, char **argv)
+{
+    if (sock >= 0)
+        return socket_send_command(c, argc, argv);
+    return x_send_command(c, argc, argv);
+}
+
+/* Open a connection to berry, preferring the IPC socket which acknowledges
+ * each command and falling back to ClientMessages on the root window.
+ */
+static bool
+connection_open(void)
+{
+    if (socket_connect())
+        return true;
+
+    display = XOpenDisplay(NULL);
+    if (!display)
+        return false;
+
+    root = DefaultRootWindow(display);
+    client_event = XInternAtom(display, BERRY_CLIENT_EVENT, False);
+    return true;
+}
+
+/* Wait until berry has seen every command and close the connection */
+static int
+connection_close(void)
+{
+    int status = IPCSuccess;
+
+    if (sock >= 0) {
+        status = socket_read_replies();
+        close(sock);
+        sock = -1;
+    } else if (display) {
         XSync(display, false);
-        return;
+        XCloseDisplay(display);
+        display = NULL;
     }
 
-    for (int i = 1; i <= argc; i++) {
-        (c->handler)(ev.xclient.data.l, c->config, i, argv);
+    return status;
+}
+
+/* Look up argv[0] in the command table and send it with its arguments */
+static int
+run_command(int argc, char **argv)
+{
+    const struct command *c;
+
+    c = command_lookup(argv[0]);
+    if (c == NULL) {
+        if (line_number > 0)
+            fprintf(stderr, "line %d: ", line_number);
+        fprintf(stderr, "Command not found %s\n", argv[0]);
+        return IPCUnknownCommand;
     }
 
-    XSendEvent(display, root, false, SubstructureRedirectMask, &ev);
-    XSync(display, false);
-    XCloseDisplay(display);
+    if (c->cmd == IPCSubscribe)
+        return run_subscribe(c, argc - 1, argv + 1);
+
+    if (c->argc >= 0 && c->argc != argc - 1) {
+        if (line_number > 0)
+            printf("line %d: ", line_number);
+        printf("Wrong number of arguments\n");
+        printf("%d expected for command %s\n", c->argc, c->name);
+        return IPCBadArgument;
+    }
+
+    return send_command(c, argc - 1, argv + 1);
+}
+
+/* Subscribe to the given events, or to all of them, and copy the stream of
+ * newline delimited JSON to stdout until berry closes the connection. Only
+ * the socket can carry a stream, so there is no ClientMessage fallback.
+ */
+static int
+run_subscribe(const struct command *c, int argc, char **argv)
+{
+    struct ipc_frame frame;
+    struct ipc_reply reply;
+    long d[5];
+    char buf[4096];
+    ssize_t n;
+
+    if (line_number > 0 || sock < 0) {
+        fprintf(stderr, "%s needs the berry socket and cannot be batched\n", c->name);
+        return IPCFailure;
+    }
+
+    command_pack(c, d, argc, argv);
+    if (d[1] < 0) {
+        report_status(c, 0, IPCBadArgument);
+        return IPCBadArgument;
+    }
+
+    memset(&frame, 0, sizeof frame);
+    for (int i = 0; i < 5; i++)
+        frame.data[i] = d[i];
+
+    if (ipc_write_all(sock, &frame, sizeof frame) < 0 || ipc_read_all(sock, &reply, sizeof reply) < 0) {
+        report_status(c, 0, -1);
+        return IPCFailure;
+    }
+    if (reply.status != IPCSuccess) {
+        report_status(c, 0, reply.status);
+        return reply.status;
+    }
+
+    while ((n = read(sock, buf, sizeof buf)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || fwrite(buf, 1, n, stdout) != (size_t)n || fflush(stdout) == EOF)
+            break;
+    }
+
+    return IPCSuccess;
+}
+
+/* Run newline separated commands from the given file ("-" for stdin) over
+ * a single connection. Lines may be prefixed with "berryc" so existing
+ * autostart scripts can be fed in unchanged.
+ */
+static int
+run_batch(const char *path)
+{
+    FILE *in;
+    char line[IPC_STRING_MAX + MAXLEN];
+    char *words[BATCH_MAX_WORDS];
+    int n, status, failed = 0;
+
+    in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    if (!connection_open()) {
+        fprintf(stderr, "Could not connect to berry\n");
+        if (in != stdin)
+            fclose(in);
+        return EXIT_FAILURE;
+    }
+
+    while (fgets(line, sizeof line, in) != NULL) {
+        line_number++;
+        n = split_line(line, words, BATCH_MAX_WORDS);
+        if (n < 0) {
+            fprintf(stderr, "line %d: too many arguments\n", line_number);
+            failed++;
+            continue;
+        }
+        if (n > 0 && strcmp(words[0], "berryc") == 0) {
+            n--;
+            memmove(words, words + 1, n * sizeof words[0]);
+        }
+        if (n == 0)
+            continue;
+        if (run_command(n, words) != IPCSuccess)
+            failed++;
+    }
+
+    status = connection_close();
+    if (in != stdin)
+        fclose(in);
+
+    return failed == 0 && status == IPCSuccess ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int
 main(int argc, char **argv)
 {
-    int c, c_argc;
-    char **c_argv;
+    int c, status;
+    bool batch = false;
 
-    c_argc = argc - 2;
-    c_argv = argv + 2;
-
-    while ((c = getopt(argc, argv, "hv")) != -1) {
+    while ((c = getopt(argc, argv, "+hvb")) != -1) {
         switch (c) {
         case 'h':
             usage(stdout);
@@ -284,24 +516,27 @@ main(int argc, char **argv)
         case 'v':
             version();
             break;
+        case 'b':
+            batch = true;
+            break;
         default:
             usage(stderr);
             break;
         }
     }
 
-    for (int i = 0; i < (int)(sizeof command_table / sizeof command_table[0]); i++) {
-        if (strcmp(argv[1], command_table[i].name) == 0) {
-            if (command_table[i].argc != c_argc) {
-                printf("Wrong number of arguments\n");
-                printf("%d expected for command %s\n", command_table[i].argc, command_table[i].name);
-                return EXIT_FAILURE;
-            }
-            send_command(&command_table[i], c_argc, c_argv);
-            return EXIT_SUCCESS;
-        }
-    }
+    if (batch || (optind < argc && strcmp(argv[optind], "-") == 0))
+        return run_batch(optind < argc ? argv[optind] : "-");
+
+    if (optind >= argc)
+        usage(stderr);
+
+    if (!connection_open())
+        return EXIT_FAILURE;
+
+    status = run_command(argc - optind, argv + optind);
+    if (connection_close() != IPCSuccess)
+        status = IPCFailure;
 
-    fprintf(stderr, "Command not found %s, exiting\n", argv[1]);
-    return EXIT_FAILURE;
+    return status == IPCSuccess ? EXIT_SUCCESS : EXIT_FAILURE;
 }
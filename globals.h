@@ -2,12 +2,16 @@
 #define __BERRY_GLOBALS_H_
 
 #define BERRY_AUTOSTART "berry/autostart"
+#define BERRY_SETTINGS "berry/berryrc"
 
 #ifndef __WINDOW_MANAGER_NAME__
 #define __WINDOW_MANAGER_NAME__ "wm"
 #endif
 
 #define MOUSEMASK (PointerMotionMask|ButtonPressMask|ButtonReleaseMask)
+#define ROOT_MASK (StructureNotifyMask|SubstructureRedirectMask|SubstructureNotifyMask|ButtonPressMask|Button1Mask)
+#define STATE_MAGIC "berry-state"
+#define STATE_VERSION 2
 
 // Taken from DWM. Many thanks. https://git.suckless.org/dwm
 #define mod_clean(mask) (mask & ~(LockMask) & \
@@ -18,8 +22,30 @@
 #endif
 
 #define MAXLEN 256
+#define STATUS_MAX 384
 #define MINIMUM_DIM 30
 #define TITLE_X_OFFSET 5
 #define DEFAULT_ALPHA 0xffff
+#define IPC_MAX_CONNS 16
+#define IPC_PIPELINE 32
+#define IPC_EVENT_BACKLOG 65536
+#define BATCH_MAX_WORDS 8
+#define QUERY_TIMEOUT 2000
+#define QUERY_PENDING 32 /* queries over X answered at the end of a pass */
+#define FONT_CACHE_SIZE 4
+#define RULE_BUCKETS 64 /* hash buckets of rules matching an exact class */
+#define RULE_MAX_WORDS 16
+#define KEYCODE_MAX 256 /* key bindings are indexed by keycode */
+#define PUBLISH_QUEUE_SIZE 256 /* property writes queued for the worker, a power of two */
+#define LOG_RING_SIZE 1024 /* debug log records, a power of two */
+#define LOG_TEXT_MAX 256
+#define RECORD_SIZE 8192 /* flight recorder entries, a power of two */
+#define RECORD_IPC 0x8000 /* record type flag for IPC commands */
+#define RECORD_WORK 0x4000 /* record type flag for deferred work, see enum record_work */
+#define RECORD_CONFIG 0x2000 /* with RECORD_IPC, the setting of an IPCConfig command */
+#define RECORD_DUMP_INTERVAL 1000000 /* us between dumps caused by slow handlers */
+#define TIMER_WHEEL_BITS 6 /* 64 slots per level of the timer wheel */
+#define TIMER_WHEEL_LEVELS 4 /* 1 ms ticks, timers up to about 4.6 hours ahead */
+#define REACTOR_EVENTS 32 /* epoll events handled per wakeup */
 
 #endif
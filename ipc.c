@@ -0,0 +1,386 @@
+/* Copyright (c) 2018 Joshua L Ervin. All rights reserved. */
+/* Licensed under the MIT License. See the LICENSE file in the project root for full license information. */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "ipc.h"
+#include "utils.h"
+
+static void fn_hex(long *, bool, int, char **);
+static void fn_int(long *, bool, int, char **);
+static void fn_bool(long *, bool, int, char **);
+static void fn_str(long *, bool, int, char **);
+static void fn_mask(long *, bool, int, char **);
+static void fn_string(long *, bool, int, char **);
+static void fn_int_string(long *, bool, int, char **);
+static void fn_query(long *, bool, int, char **);
+static void fn_events(long *, bool, int, char **);
+static void fn_layout(long *, bool, int, char **);
+
+const struct command command_table[] = {
+    { "window_move",            IPCWindowMoveRelative,      false, 2, fn_int        },
+    { "window_move_absolute",   IPCWindowMoveAbsolute,      false, 2, fn_int        },
+    { "window_resize",          IPCWindowResizeRelative,    false, 2, fn_int        },
+    { "window_resize_absolute", IPCWindowResizeAbsolute,    false, 2, fn_int        },
+    { "window_raise",           IPCWindowRaise,             false, 0, NULL          },
+    { "window_monocle",         IPCWindowMonocle,           false, 0, NULL          },
+    { "window_close",           IPCWindowClose,             false, 0, NULL          },
+    { "window_kill",            IPCWindowKill,              false, 0, NULL          },
+    { "window_center",          IPCWindowCenter,            false, 0, NULL          },
+    { "window_below",           IPCBelow,                   false, 0, NULL          },
+    { "focus_color",            IPCFocusColor,              true,  1, fn_hex        },
+    { "unfocus_color",          IPCUnfocusColor,            true,  1, fn_hex        },
+    { "inner_focus_color",      IPCInnerFocusColor,         true,  1, fn_hex        },
+    { "inner_unfocus_color",    IPCInnerUnfocusColor,       true,  1, fn_hex        },
+    { "text_focus_color",       IPCTitleFocusColor,         true,  1, fn_hex        },
+    { "text_unfocus_color",     IPCTitleUnfocusColor,       true,  1, fn_hex        },
+    { "border_width",           IPCBorderWidth,             true,  1, fn_int        },
+    { "inner_border_width",     IPCInnerBorderWidth,        true,  1, fn_int        },
+    { "title_height",           IPCTitleHeight,             true,  1, fn_int        },
+    { "switch_workspace",       IPCSwitchWorkspace,         false, 1, fn_int        },
+    { "send_to_workspace",      IPCSendWorkspace,           false, 1, fn_int        },
+    { "fullscreen",             IPCFullscreen,              false, 0, NULL          },
+    { "fullscreen_state",       IPCFullscreenState,         false, 0, NULL          },
+    { "fullscreen_remove_dec",  IPCFullscreenRemoveDec,     true,  1, fn_bool       },
+    { "fullscreen_max",         IPCFullscreenMax,           true,  1, fn_bool       },
+    { "snap_left",              IPCSnapLeft,                false, 0, NULL          },
+    { "snap_right",             IPCSnapRight,               false, 0, NULL          },
+    { "cardinal_focus",         IPCCardinalFocus,           false, 1, fn_int        },
+    { "toggle_decorations",     IPCWindowToggleDecorations, false, 0, NULL          },
+    { "cycle_focus",            IPCCycleFocus,              false, 0, NULL          },
+    { "pointer_focus",          IPCPointerFocus,            false, 0, NULL          },
+    { "quit",                   IPCQuit,                    true,  0, NULL          },
+    { "restart",                IPCRestart,                 false, 0, NULL          },
+    { "layout",                 IPCLayout,                  false, 1, fn_layout     },
+    { "auto_layout",            IPCAutoLayout,              true,  1, fn_bool       },
+    { "top_gap",                IPCTopGap,                  true,  1, fn_int        },
+    { "edge_gap",               IPCEdgeGap,                 false, 4, fn_int        },
+    { "save_monitor",           IPCSaveMonitor,             false, 2, fn_int        },
+    { "smart_place",            IPCSmartPlace,              true,  1, fn_bool       },
+    { "draw_text",              IPCDrawText,                true,  1, fn_bool       },
+    { "edge_lock",              IPCEdgeLock,                true,  1, fn_bool       },
+    { "edge_snap",              IPCEdgeSnap,                true,  1, fn_bool       },
+    { "snap_distance",          IPCSnapDistance,            true,  1, fn_int        },
+    { "set_font",               IPCSetFont,                 false, 1, fn_string     },
+    { "json_status",            IPCJSONStatus,              true,  1, fn_bool       },
+    { "manage",                 IPCManage,                  true,  1, fn_str        },
+    { "unmanage",               IPCUnmanage,                true,  1, fn_str        },
+    { "decorate_new",           IPCDecorate,                true,  1, fn_bool       },
+    { "name_desktop",           IPCNameDesktop,             false, 2, fn_int_string },
+    { "rule",                   IPCRule,                    false, 1, fn_string     },
+    { "clear_rules",            IPCClearRules,              false, 0, NULL          },
+    { "bind",                   IPCBind,                    false, 1, fn_string     },
+    { "clear_bindings",         IPCClearBindings,           false, 0, NULL          },
+    { "focus_button",           IPCFocusButton,             true,  1, fn_int        },
+    { "move_button",            IPCMoveButton,              true,  1, fn_int        },
+    { "move_mask",              IPCMoveMask,                true,  1, fn_mask       },
+    { "resize_button",          IPCResizeButton,            true,  1, fn_int        },
+    { "resize_mask",            IPCResizeMask,              true,  1, fn_mask       },
+    { "pointer_interval",       IPCPointerInterval,         true,  1, fn_int        },
+    { "status_interval",        IPCStatusInterval,          true,  1, fn_int        },
+    { "title_interval",         IPCTitleInterval,           true,  1, fn_int        },
+    { "focus_follows_pointer",  IPCFocusFollowsPointer,     true,  1, fn_bool       },
+    { "focus_on_click",         IPCFocusOnClick,            true,  1, fn_bool       },
+    { "warp_pointer",           IPCWarpPointer,             true,  1, fn_bool       },
+    { "dump_stats",             IPCDumpStats,               false, 0, NULL          },
+    { "dump_record",            IPCDumpRecord,              false, 0, NULL          },
+    { "slow_threshold",         IPCSlowThreshold,           true,  1, fn_int        },
+    { "query",                  IPCQuery,                   false, 1, fn_query      },
+    { "subscribe",              IPCSubscribe,               false, -1, fn_events    },
+};
+
+const int command_count = sizeof command_table / sizeof command_table[0];
+
+const char *const event_names[EventLast] = {
+    [EventFocus]     = "focus",
+    [EventWorkspace] = "workspace",
+    [EventMap]       = "map",
+    [EventUnmap]     = "unmap",
+    [EventMove]      = "move",
+    [EventResize]    = "resize",
+    [EventState]     = "state",
+    [EventConfig]    = "config",
+};
+
+static void
+fn_hex(long *data, bool b, int i, char **argv)
+{
+    UNUSED(b);
+    data[i+b] = strtoul(argv[i - 1], NULL, 16);
+}
+
+static void
+fn_int(long *data, bool b, int i, char **argv)
+{
+    UNUSED(b);
+    data[i+b] = strtol(argv[i - 1], NULL, 10);
+}
+
+static void
+fn_bool(long *data, bool b, int i, char **argv)
+{
+    UNUSED(b);
+    data[i+b] = strcmp(argv[i-1], "true") == 0 ? 1 : 0;
+}
+
+static void
+fn_str(long *data, bool b, int i, char **argv)
+{
+    UNUSED(b);
+    // lord forgive me for I have sinned
+    if (strcmp(argv[i-1], "Dialog") == 0) data[i+b] = Dialog;
+    else if (strcmp(argv[i-1], "Toolbar") == 0) data[i+b] = Toolbar;
+    else if (strcmp(argv[i-1], "Menu") == 0) data[i+b] = Menu;
+    else if (strcmp(argv[i-1], "Splash") == 0) data[i+b] = Splash;
+    else if (strcmp(argv[i-1], "Utility") == 0) data[i+b] = Utility;
+}
+
+static void
+fn_mask(long *data, bool b, int i, char **argv)
+{
+    UNUSED(b);
+    data[i+b] = 0;
+    char * mask_str = strtok( argv[i-1] , "|");
+
+    while( mask_str != NULL ) {
+        if( ! strcmp(mask_str,"shift") ) data[i+b] = data[i+b]|ShiftMask;
+        else if( !strcmp(mask_str,"lock") ) data[i+b] = data[i+b]|LockMask;
+        else if( !strcmp(mask_str,"ctrl") ) data[i+b] = data[i+b]|ControlMask;
+        else if( !strcmp(mask_str,"mod1") ) data[i+b] = data[i+b]|Mod1Mask;
+        else if( !strcmp(mask_str,"mod2") ) data[i+b] = data[i+b]|Mod2Mask;
+        else if( !strcmp(mask_str,"mod3") ) data[i+b] = data[i+b]|Mod3Mask;
+        else if( !strcmp(mask_str,"mod4") ) data[i+b] = data[i+b]|Mod4Mask;
+        else if( !strcmp(mask_str,"mod5") ) data[i+b] = data[i+b]|Mod5Mask;
+        else {
+            printf("%s is not a valid modifier", mask_str);
+            data[i+b]=0;
+            break;
+        }
+        mask_str = strtok(NULL, "|");
+    }
+}
+
+/* Commands whose last argument is a string carry it outside of the
+ * data words, see command_pack
+ */
+static void
+fn_string(long *data, bool b, int i, char **argv)
+{
+    UNUSED(data);
+    UNUSED(b);
+    UNUSED(i);
+    UNUSED(argv);
+}
+
+static void
+fn_int_string(long *data, bool b, int i, char **argv)
+{
+    if (i == 1)
+        fn_int(data, b, i, argv);
+}
+
+static void
+fn_query(long *data, bool b, int i, char **argv)
+{
+    if (strcmp(argv[i-1], "windows") == 0) data[i+b] = QueryWindows;
+    else if (strcmp(argv[i-1], "workspaces") == 0) data[i+b] = QueryWorkspaces;
+    else if (strcmp(argv[i-1], "monitors") == 0) data[i+b] = QueryMonitors;
+    else if (strcmp(argv[i-1], "focused") == 0) data[i+b] = QueryFocused;
+    else data[i+b] = QueryLast;
+}
+
+static void
+fn_layout(long *data, bool b, int i, char **argv)
+{
+    if (strcmp(argv[i-1], "floating") == 0) data[i+b] = LayoutFloating;
+    else if (strcmp(argv[i-1], "master") == 0) data[i+b] = LayoutMaster;
+    else if (strcmp(argv[i-1], "grid") == 0) data[i+b] = LayoutGrid;
+    else if (strcmp(argv[i-1], "columns") == 0) data[i+b] = LayoutColumns;
+    else data[i+b] = LayoutLast;
+}
+
+/* Subscriptions take any number of event names, collected into a mask */
+static void
+fn_events(long *data, bool b, int i, char **argv)
+{
+    int e;
+
+    for (e = 0; e < EventLast; e++)
+        if (strcmp(argv[i-1], event_names[e]) == 0)
+            break;
+
+    if (e == EventLast || data[1+b] < 0)
+        data[1+b] = -1;
+    else
+        data[1+b] |= 1 << e;
+}
+
+const struct command *
+command_lookup(const char *name)
+{
+    for (int i = 0; i < command_count; i++)
+        if (strcmp(name, command_table[i].name) == 0)
+            return &command_table[i];
+
+    return NULL;
+}
+
+/* Name of a command, config telling whether cmd came in d[1] of an
+ * IPCConfig message. Returns "unknown" for commands not in the table.
+ */
+const char *
+command_name(long cmd, bool config)
+{
+    for (int i = 0; i < command_count; i++)
+        if ((long)command_table[i].cmd == cmd && command_table[i].config == config)
+            return command_table[i].name;
+
+    return "unknown";
+}
+
+/* Fill the five data words for the given command and its arguments and
+ * return its string argument, if it has one.
+ *
+ * We use the following protocol:
+ * If the given command is related to berry's config then assign it a value of
+ * IPCConfig at d[0]. Then, assign the specific config element at d[1], shifting
+ * all values up by one.
+ * Otherwise, set the IPC command at d[0] and assign arguments from 1 upwards.
+ */
+const char *
+command_pack(const struct command *c, long *data, int argc, char **argv)
+{
+    memset(data, 0, 5 * sizeof(long));
+
+    if (c->config) {
+        data[0] = IPCConfig;
+        data[1] = c->cmd;
+    } else {
+        data[0] = c->cmd;
+    }
+
+    for (int i = 1; i <= argc; i++)
+        (c->handler)(data, c->config, i, argv);
+
+    if (argc > 0 && (c->handler == fn_string || c->handler == fn_int_string))
+        return argv[argc - 1];
+
+    return NULL;
+}
+
+/* Split a line into whitespace separated words, honouring single and
+ * double quotes. Everything following a '#' is a comment.
+ * Returns the number of words, or -1 if there are more than max.
+ */
+int
+split_line(char *line, char **words, int max)
+{
+    char *p = line, *out, quote;
+    int n = 0;
+
+    while (*p) {
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            break;
+        if (n == max)
+            return -1;
+
+        words[n++] = out = p;
+        quote = 0;
+        while (*p && (quote || !isspace((unsigned char)*p))) {
+            if (quote && *p == quote) {
+                quote = 0;
+                p++;
+            } else if (!quote && (*p == '"' || *p == '\'')) {
+                quote = *p++;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        if (*p)
+            p++;
+        *out = '\0';
+    }
+
+    return n;
+}
+
+
+/* Build the path of a per-display file, e.g. $XDG_RUNTIME_DIR/berry-:0.sock
+ * for suffix "sock". Returns -1 if no runtime directory is available or the
+ * path does not fit.
+ */
+int
+ipc_runtime_path(char *buf, size_t size, const char *display_name, const char *suffix)
+{
+    const char *dir;
+    int n;
+
+    dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == NULL || dir[0] == '\0')
+        return -1;
+
+    if (display_name == NULL && (display_name = getenv("DISPLAY")) == NULL)
+        return -1;
+
+    n = snprintf(buf, size, "%s/%s-%s.%s", dir, BERRY_SOCKET_NAME, display_name, suffix);
+    if (n < 0 || (size_t)n >= size)
+        return -1;
+
+    return 0;
+}
+
+int
+ipc_socket_path(char *buf, size_t size, const char *display_name)
+{
+    return ipc_runtime_path(buf, size, display_name, "sock");
+}
+
+int
+ipc_read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int
+ipc_write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
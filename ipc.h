@@ -1,9 +1,19 @@
 #ifndef _BERRY_IPC_H_
 #define _BERRY_IPC_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define BERRY_CLIENT_EVENT "BERRY_CLIENT_EVENT"
 #define BERRY_FONT_PROPERTY "BERRY_FONT_PROPERTY"
 #define BERRY_WINDOW_STATUS "BERRY_WINDOW_STATUS"
+#define BERRY_STATS "BERRY_STATS"
+#define BERRY_QUERY_REPLY "BERRY_QUERY_REPLY"
+
+/* Name of the per-display socket created under $XDG_RUNTIME_DIR */
+#define BERRY_SOCKET_NAME "berry"
+#define IPC_STRING_MAX 4096
 
 enum IPCCommand
 {
@@ -62,6 +72,22 @@ enum IPCCommand
     IPCFocusOnClick,
     IPCFocusButton,
     IPCBelow,
+    IPCDumpStats,
+    IPCQuery,
+    IPCSubscribe,
+    IPCStatusInterval,
+    IPCRestart,
+    IPCLayout,
+    IPCAutoLayout,
+    IPCSlowThreshold,
+    IPCDumpRecord,
+    IPCTitleInterval,
+    IPCRule,
+    IPCClearRules,
+    IPCEdgeSnap,
+    IPCSnapDistance,
+    IPCBind,
+    IPCClearBindings,
     IPCLast
 };
 
@@ -76,4 +102,88 @@ enum WindowType
     WindowLast
 };
 
+/* Arrangements available through berryc layout */
+enum LayoutKind
+{
+    LayoutFloating,
+    LayoutMaster,
+    LayoutGrid,
+    LayoutColumns,
+    LayoutLast
+};
+
+/* Snapshots available through berryc query */
+enum IPCQueryKind
+{
+    QueryWindows,
+    QueryWorkspaces,
+    QueryMonitors,
+    QueryFocused,
+    QueryLast
+};
+
+/* Events streamed to subscribed connections, see berryc subscribe */
+enum IPCEvent
+{
+    EventFocus,
+    EventWorkspace,
+    EventMap,
+    EventUnmap,
+    EventMove,
+    EventResize,
+    EventState,
+    EventConfig,
+    EventLast
+};
+
+enum IPCStatus
+{
+    IPCSuccess,
+    IPCUnknownCommand,
+    IPCBadArgument,
+    IPCFailure
+};
+
+/* Socket protocol: each request is an ipc_frame followed by `length` bytes
+ * of string payload (font name, desktop name, ...). data uses the same
+ * layout as the BERRY_CLIENT_EVENT ClientMessage. Every request is answered
+ * by an ipc_reply, followed by `length` bytes of reply payload.
+ */
+struct ipc_frame
+{
+    uint32_t length;
+    int32_t data[5];
+};
+
+struct ipc_reply
+{
+    int32_t status;
+    uint32_t length;
+};
+
+/* An entry of the table of commands understood by berryc and the
+ * native config file. handler packs argument i into the data words.
+ */
+struct command
+{
+    const char* name;
+    enum IPCCommand cmd;
+    bool config;
+    int argc; /* -1 for any number of arguments */
+    void (*handler)(long *, bool, int, char **);
+};
+
+extern const struct command command_table[];
+extern const int command_count;
+extern const char *const event_names[EventLast];
+
+const struct command *command_lookup(const char *name);
+const char *command_name(long cmd, bool config);
+const char *command_pack(const struct command *c, long *data, int argc, char **argv);
+int split_line(char *line, char **words, int max);
+int ipc_runtime_path(char *buf, size_t size, const char *display_name, const char *suffix);
+int ipc_socket_path(char *buf, size_t size, const char *display_name);
+int ipc_read_all(int fd, void *buf, size_t len);
+int ipc_write_all(int fd, const void *buf, size_t len);
+
 #endif
@@ -0,0 +1,145 @@
+#!/bin/bash
+#
+# Check the X requests and round trips berry issues for common operations
+# against the budgets in budget.txt. berry runs alone on a fresh Xvfb, once
+# with a few and once with many windows; replay.c drives it and the flight
+# recorder reports what every operation cost, so a handler that turns
+# quadratic in the number of windows blows its per_window budget.
+#
+#   ./budget.sh [-u] [berry]
+#
+# berry defaults to ../.o/berry. With -u the measured costs are printed in
+# the format of budget.txt, with some headroom, instead of being checked.
+# Requires Xvfb, pkg-config and the XTEST library, and a configured tree.
+
+cd "$(dirname "$0")" || exit 1
+
+update=false
+if [ "$1" = "-u" ]; then
+    update=true
+    shift
+fi
+berry=$(realpath "${1:-../.o/berry}")
+sizes="4 16"
+
+if [ ! -f ../config.h ]; then
+    echo "config.h not found, run ./configure first" >&2
+    exit 1
+fi
+if ! command -v Xvfb >/dev/null; then
+    echo "Xvfb not found, skipping" >&2
+    exit 77
+fi
+
+tmp=$(mktemp -d)
+trap 'kill $berry_pid $xvfb_pid 2>/dev/null; rm -rf "$tmp"' EXIT
+
+${CC:-cc} -std=c99 -O2 -I.. $(pkg-config --cflags x11 xft xtst) -o "$tmp/replay" \
+    replay.c ../ipc.c ../utils.c $(pkg-config --libs x11 xtst) || exit 1
+
+# Map n windows, then run every operation once on the last one mapped
+trace() {
+    local t=0
+    for i in $(seq "$1"); do
+        echo "$t map $i 400 300 \"window $i\""
+        t=$((t + 20))
+    done
+    for op in cycle_focus "window_move 20 20" "window_resize 20 20" \
+              "switch_workspace 1" "switch_workspace 0" "send_to_workspace 2" \
+              "border_width 4" fullscreen fullscreen dump_record; do
+        echo "$t berryc $op"
+        t=$((t + 20))
+    done
+}
+
+# Reduce a flight recorder dump to "operation requests round_trips", the
+# most expensive occurrence of each operation
+measure() {
+    awk '
+        $3 == "x" && $4 == 20         { op = "map" }
+        $3 == "ipc" && $4 == "cycle_focus" { op = "focus" }
+        $3 == "ipc" && $4 == "window_move" { op = "move" }
+        $3 == "ipc" && $4 == "window_resize" { op = "resize" }
+        $3 == "ipc" && ($4 == "switch_workspace" || $4 == "send_to_workspace" || $4 == "fullscreen") { op = $4 }
+        $3 == "work" && $4 == "refresh_config" { op = $4 }
+        op != "" {
+            if ($6 > req[op]) req[op] = $6
+            if ($7 > rt[op]) rt[op] = $7
+            seen[op] = 1
+            op = ""
+        }
+        END { for (o in seen) print o, req[o], rt[o] }' "$1"
+}
+
+for n in $sizes; do
+    mkdir -p "$tmp/run$n" "$tmp/config$n"
+    chmod 700 "$tmp/run$n"
+    trace "$n" > "$tmp/trace$n"
+
+    Xvfb -displayfd 3 -screen 0 1920x1080x24 -nolisten tcp 3>"$tmp/display" 2>/dev/null &
+    xvfb_pid=$!
+    for _ in $(seq 50); do
+        [ -s "$tmp/display" ] && break
+        sleep 0.1
+    done
+    display=":$(cat "$tmp/display")"
+    : > "$tmp/display"
+
+    XDG_RUNTIME_DIR="$tmp/run$n" XDG_CONFIG_HOME="$tmp/config$n" DISPLAY=$display "$berry" &
+    berry_pid=$!
+    for _ in $(seq 50); do
+        [ -S "$tmp/run$n/berry-$display.sock" ] && break
+        sleep 0.1
+    done
+
+    DISPLAY=$display "$tmp/replay" "$tmp/trace$n" > /dev/null
+    status=$?
+    kill $berry_pid $xvfb_pid
+    wait $berry_pid $xvfb_pid 2>/dev/null
+    if [ $status -ne 0 ] || [ ! -f "$tmp/run$n/berry-$display.record" ]; then
+        echo "replay failed with $n windows" >&2
+        exit 1
+    fi
+    measure "$tmp/run$n/berry-$display.record" | sed "s/^/$n /" >> "$tmp/measured"
+done
+
+if $update; then
+    # Fit base + per_window * n through the smallest and largest run and
+    # leave a quarter of headroom
+    awk -v lo="${sizes%% *}" -v hi="${sizes##* }" '
+        { v[$1, $2, "req"] = $3; v[$1, $2, "rt"] = $4; ops[$2] = 1 }
+        function fit(op, k,   per, base) {
+            per = (v[hi, op, k] - v[lo, op, k]) / (hi - lo)
+            per = per < 0 ? 0 : int(per * 1.25 + 0.99)
+            base = v[lo, op, k] - per * lo
+            base = base < 0 ? 0 : int(base * 1.25 + 2)
+            return sprintf("%-5d %-13d", base, per)
+        }
+        END {
+            for (op in ops)
+                printf "%-21s %s %s\n", op, fit(op, "req"), fit(op, "rt")
+        }' "$tmp/measured" | sed 's/ *$//' | sort
+    exit 0
+fi
+
+awk '
+    FNR == NR {
+        if ($0 !~ /^#/ && NF == 5) { rb[$1] = $2; rp[$1] = $3; tb[$1] = $4; tp[$1] = $5 }
+        next
+    }
+    !($2 in rb) { printf "FAIL %s has no budget, see ./budget.sh -u\n", $2; failed = 1; next }
+    {
+        req = rb[$2] + rp[$2] * $1; rt = tb[$2] + tp[$2] * $1
+        checked[$2] = 1
+        if ($3 > req || $4 > rt) {
+            printf "FAIL %s with %d windows: %d requests, %d round trips, budget %d and %d\n", $2, $1, $3, $4, req, rt
+            failed = 1
+        } else {
+            printf "ok   %s with %d windows: %d requests, %d round trips\n", $2, $1, $3, $4
+        }
+    }
+    END {
+        for (op in rb)
+            if (!(op in checked)) { printf "FAIL %s was not measured\n", op; failed = 1 }
+        exit failed
+    }' budget.txt "$tmp/measured"
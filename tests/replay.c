@@ -0,0 +1,441 @@
+/* Copyright (c) 2018 Joshua L Ervin. All rights reserved. */
+/* Licensed under the MIT License. See the LICENSE file in the project root for full license information. */
+
+/* Replay a trace of client activity against a running berry and report the
+ * latency of every operation. Built and driven by replay.sh.
+ *
+ * Each trace line is "<ms> <op> <args...>", ms being the earliest time since
+ * the start of the pass at which the operation is issued. Operations run one
+ * at a time, in order:
+ *
+ *   map ID W H [TITLE]          create window ID on first use and map it
+ *   unmap ID                    unmap window ID
+ *   configure ID X Y W H        request a new geometry for window ID
+ *   title ID TITLE              set WM_NAME and _NET_WM_NAME of window ID
+ *   drag ID DX DY [STEPS]       drag window ID by its title bar with XTest
+ *   berryc COMMAND [ARGS...]    send a berryc command as a ClientMessage
+ *
+ * A map is complete when the window is mapped, berry only maps it once it is
+ * placed. Everything else is complete when berry answers a query sent right
+ * after it: berry handles X events in order, so the answer proves the
+ * operation was fully handled and its requests reached the server.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XTest.h>
+
+#include "globals.h"
+#include "ipc.h"
+#include "utils.h"
+
+#define MAX_WINDOWS 256
+#define MAX_WORDS 16
+#define MAX_GROUPS 128
+#define DRAG_GRAB_Y 10 /* px above the window, inside the default title bar */
+
+enum op {
+    OpMap,
+    OpUnmap,
+    OpConfigure,
+    OpTitle,
+    OpDrag,
+    OpBerryc,
+    OpLast
+};
+
+static const char *op_names[OpLast] = {
+    [OpMap]       = "map",
+    [OpUnmap]     = "unmap",
+    [OpConfigure] = "configure",
+    [OpTitle]     = "title",
+    [OpDrag]      = "drag",
+    [OpBerryc]    = "berryc",
+};
+
+/* Latencies of one kind of operation, berryc commands are kept per command */
+struct group {
+    char name[64];
+    unsigned long *us;
+    size_t n, cap;
+};
+
+static Display *display;
+static Window root, marker;
+static Atom client_event, net_wm_name, utf8_string;
+static Window windows[MAX_WINDOWS];
+static struct group groups[MAX_GROUPS];
+static int group_count = 0;
+static bool verbose = false;
+
+static unsigned long
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sleep_until(unsigned long us)
+{
+    unsigned long now = now_us();
+    struct timespec ts;
+
+    if (now >= us)
+        return;
+    ts.tv_sec = (us - now) / 1000000;
+    ts.tv_nsec = (us - now) % 1000000 * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* Read events until one of the given type arrives for w. Returns the time it
+ * was read, or 0 if berry did not produce it within QUERY_TIMEOUT.
+ */
+static unsigned long
+wait_for(int type, Window w)
+{
+    struct pollfd pfd = { .fd = ConnectionNumber(display), .events = POLLIN };
+    XEvent ev;
+
+    XFlush(display);
+    for (;;) {
+        if (!XPending(display) && poll(&pfd, 1, QUERY_TIMEOUT) <= 0)
+            return 0;
+        XNextEvent(display, &ev);
+        if (ev.type == type && ev.xany.window == w)
+            return now_us();
+    }
+}
+
+/* Ask berry for the focused window and wait for the answer. berry answers
+ * queries over X only after the deferred work of the batch, refreshed
+ * settings, titles and drag steps included, has been done.
+ */
+static unsigned long
+barrier(void)
+{
+    XEvent ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.xclient.type = ClientMessage;
+    ev.xclient.window = root;
+    ev.xclient.message_type = client_event;
+    ev.xclient.format = 32;
+    ev.xclient.data.l[0] = IPCQuery;
+    ev.xclient.data.l[1] = QueryFocused;
+    ev.xclient.data.l[2] = marker;
+    XSendEvent(display, root, false, SubstructureRedirectMask, &ev);
+    return wait_for(PropertyNotify, marker);
+}
+
+static struct group *
+group_get(const char *name)
+{
+    for (int i = 0; i < group_count; i++)
+        if (strcmp(groups[i].name, name) == 0)
+            return &groups[i];
+    if (group_count == MAX_GROUPS)
+        return NULL;
+    snprintf(groups[group_count].name, sizeof groups[group_count].name, "%s", name);
+    return &groups[group_count++];
+}
+
+static void
+group_add(const char *name, unsigned long us)
+{
+    struct group *g = group_get(name);
+
+    if (g == NULL)
+        return;
+    if (g->n == g->cap) {
+        size_t cap = g->cap ? g->cap * 2 : 64;
+        unsigned long *tmp = realloc(g->us, cap * sizeof *tmp);
+        if (tmp == NULL)
+            return;
+        g->us = tmp;
+        g->cap = cap;
+    }
+    g->us[g->n++] = us;
+}
+
+static int
+compare_ul(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+static Window
+window_get(const char *id, bool create, int w, int h)
+{
+    int i = atoi(id);
+
+    if (i < 0 || i >= MAX_WINDOWS)
+        return None;
+    if (windows[i] == None && create) {
+        windows[i] = XCreateSimpleWindow(display, root, 0, 0, w, h, 0, 0, 0xffffff);
+        XSelectInput(display, windows[i], StructureNotifyMask);
+    }
+    return windows[i];
+}
+
+static void
+window_set_title(Window w, const char *title)
+{
+    XStoreName(display, w, title);
+    XChangeProperty(display, w, net_wm_name, utf8_string, 8, PropModeReplace,
+            (const unsigned char *)title, strlen(title));
+}
+
+static void
+window_drag(Window w, int dx, int dy, int steps)
+{
+    XWindowAttributes wa;
+    Window child;
+    int x, y;
+
+    XGetWindowAttributes(display, w, &wa);
+    XTranslateCoordinates(display, w, root, 0, 0, &x, &y, &child);
+    x += wa.width / 2;
+    y -= DRAG_GRAB_Y;
+
+    XTestFakeMotionEvent(display, -1, x, y, CurrentTime);
+    XTestFakeButtonEvent(display, Button1, True, CurrentTime);
+    for (int i = 1; i <= steps; i++)
+        XTestFakeMotionEvent(display, -1, x + dx * i / steps, y + dy * i / steps, CurrentTime);
+    XTestFakeButtonEvent(display, Button1, False, CurrentTime);
+}
+
+/* Run a single trace line. Returns false on a malformed line or when berry
+ * stops answering.
+ */
+static bool
+replay_line(const char *path, int lineno, char **words, int n, unsigned long start)
+{
+    char name[64];
+    enum op op;
+    unsigned long t0, t1;
+    Window w = None;
+    XEvent ev;
+
+    for (op = 0; op < OpLast; op++)
+        if (strcmp(words[1], op_names[op]) == 0)
+            break;
+
+    if (op == OpLast ||
+            (op == OpMap && n < 5) || (op == OpUnmap && n != 3) || (op == OpConfigure && n != 7) ||
+            (op == OpTitle && n != 4) || (op == OpDrag && n != 5 && n != 6) || (op == OpBerryc && n < 3)) {
+        fprintf(stderr, "%s:%d: malformed operation\n", path, lineno);
+        return false;
+    }
+
+    if (op != OpBerryc) {
+        if (op == OpMap)
+            w = window_get(words[2], true, atoi(words[3]), atoi(words[4]));
+        else
+            w = window_get(words[2], false, 0, 0);
+        if (w == None) {
+            fprintf(stderr, "%s:%d: unknown window %s\n", path, lineno, words[2]);
+            return false;
+        }
+    }
+    snprintf(name, sizeof name, "%s", op_names[op]);
+
+    sleep_until(start + strtoul(words[0], NULL, 10) * 1000);
+    t0 = now_us();
+    switch (op) {
+        case OpMap:
+            if (n > 5)
+                window_set_title(w, words[5]);
+            XMapWindow(display, w);
+            t1 = wait_for(MapNotify, w);
+            if (t1 != 0 && barrier() == 0)
+                t1 = 0;
+            break;
+        case OpUnmap:
+            XUnmapWindow(display, w);
+            t1 = barrier();
+            break;
+        case OpConfigure:
+            XMoveResizeWindow(display, w, atoi(words[3]), atoi(words[4]), atoi(words[5]), atoi(words[6]));
+            t1 = barrier();
+            break;
+        case OpTitle:
+            window_set_title(w, words[3]);
+            t1 = barrier();
+            break;
+        case OpDrag:
+            window_drag(w, atoi(words[3]), atoi(words[4]), n == 6 ? atoi(words[5]) : 10);
+            t1 = barrier();
+            break;
+        case OpBerryc: {
+            const struct command *c = command_lookup(words[2]);
+            if (c == NULL || (c->argc >= 0 && c->argc != n - 3) || c->cmd == IPCQuery ||
+                    c->cmd == IPCSubscribe || c->cmd == IPCRestart || c->cmd == IPCQuit ||
+                    c->cmd == IPCSetFont || c->cmd == IPCNameDesktop) {
+                fprintf(stderr, "%s:%d: unsupported berryc command\n", path, lineno);
+                return false;
+            }
+            memset(&ev, 0, sizeof ev);
+            ev.xclient.type = ClientMessage;
+            ev.xclient.window = root;
+            ev.xclient.message_type = client_event;
+            ev.xclient.format = 32;
+            command_pack(c, ev.xclient.data.l, n - 3, words + 3);
+            t0 = now_us();
+            XSendEvent(display, root, false, SubstructureRedirectMask, &ev);
+            t1 = barrier();
+            snprintf(name, sizeof name, "berryc %s", c->name);
+            break;
+        }
+        default:
+            return false;
+    }
+
+    if (t1 == 0) {
+        fprintf(stderr, "%s:%d: berry did not answer within %d ms\n", path, lineno, QUERY_TIMEOUT);
+        return false;
+    }
+
+    group_add(name, t1 - t0);
+    if (verbose)
+        printf("%d %s %lu\n", lineno, name, t1 - t0);
+    return true;
+}
+
+/* Replay the whole trace once, then destroy its windows */
+static bool
+replay_pass(const char *path)
+{
+    char line[IPC_STRING_MAX], *words[MAX_WORDS];
+    unsigned long start;
+    int lineno = 0, n;
+    bool ok = true;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+
+    start = now_us();
+    while (ok && fgets(line, sizeof line, f) != NULL) {
+        lineno++;
+        line[strcspn(line, "\n")] = '\0';
+        n = split_line(line, words, MAX_WORDS);
+        if (n == 0)
+            continue;
+        if (n < 2) {
+            fprintf(stderr, "%s:%d: expected a time and an operation\n", path, lineno);
+            ok = false;
+            break;
+        }
+        ok = replay_line(path, lineno, words, n, start);
+    }
+    fclose(f);
+
+    for (int i = 0; i < MAX_WINDOWS; i++) {
+        if (windows[i] != None) {
+            XDestroyWindow(display, windows[i]);
+            windows[i] = None;
+        }
+    }
+    barrier();
+
+    return ok;
+}
+
+/* One line per operation, in the order they first appear in the trace, so
+ * that the reports of two builds can be joined line by line.
+ */
+static void
+report(void)
+{
+    printf("# operation count median_us p90_us max_us\n");
+    for (int i = 0; i < group_count; i++) {
+        struct group *g = &groups[i];
+        qsort(g->us, g->n, sizeof *g->us, compare_ul);
+        printf("%s\t%zu %lu %lu %lu\n", g->name, g->n, g->us[g->n / 2],
+                g->us[MIN(g->n * 9 / 10, g->n - 1)], g->us[g->n - 1]);
+    }
+}
+
+static void
+usage(FILE *out)
+{
+    fprintf(out, "Usage: replay [-v] [-n passes] trace\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt, passes = 1, event, error, major, minor;
+
+    while ((opt = getopt(argc, argv, "hvn:")) != -1) {
+        switch (opt) {
+            case 'n':
+                passes = atoi(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'h':
+                usage(stdout);
+                return EXIT_SUCCESS;
+            default:
+                usage(stderr);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 || passes < 1) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    display = XOpenDisplay(NULL);
+    if (display == NULL) {
+        fprintf(stderr, "replay: cannot open display\n");
+        return EXIT_FAILURE;
+    }
+    if (!XTestQueryExtension(display, &event, &error, &major, &minor)) {
+        fprintf(stderr, "replay: the XTEST extension is required\n");
+        return EXIT_FAILURE;
+    }
+
+    root = DefaultRootWindow(display);
+    client_event = XInternAtom(display, BERRY_CLIENT_EVENT, False);
+    net_wm_name = XInternAtom(display, "_NET_WM_NAME", False);
+    utf8_string = XInternAtom(display, "UTF8_STRING", False);
+    marker = XCreateSimpleWindow(display, root, -1, -1, 1, 1, 0, 0, 0);
+    XSelectInput(display, marker, PropertyChangeMask);
+
+    if (barrier() == 0) {
+        fprintf(stderr, "replay: berry is not answering on %s\n", DisplayString(display));
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < passes; i++)
+        if (!replay_pass(argv[optind]))
+            return EXIT_FAILURE;
+
+    report();
+    XCloseDisplay(display);
+    return EXIT_SUCCESS;
+}
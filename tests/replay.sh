@@ -0,0 +1,92 @@
+#!/bin/bash
+#
+# Replay a trace against one or more berry binaries, each running alone on
+# a fresh Xvfb with the default settings, and report the latency of every
+# operation. With several binaries the median latencies are printed side by
+# side, followed by the change of each build relative to the first one.
+#
+#   ./replay.sh [-n passes] trace.trace berry [berry...]
+#
+# See replay.c for the trace format and basic.trace for an example.
+# Requires Xvfb, pkg-config and the XTEST library, and a configured tree.
+
+cd "$(dirname "$0")" || exit 1
+
+passes=1
+if [ "$1" = "-n" ]; then
+    passes=$2
+    shift 2
+fi
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 [-n passes] trace berry [berry...]" >&2
+    exit 1
+fi
+trace=$(realpath "$1")
+shift
+
+if [ ! -f ../config.h ]; then
+    echo "config.h not found, run ./configure first" >&2
+    exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'kill $berry_pid $xvfb_pid 2>/dev/null; rm -rf "$tmp"' EXIT
+
+${CC:-cc} -std=c99 -O2 -I.. $(pkg-config --cflags x11 xft xtst) -o "$tmp/replay" \
+    replay.c ../ipc.c ../utils.c $(pkg-config --libs x11 xtst) || exit 1
+
+n=0
+for berry in "$@"; do
+    n=$((n + 1))
+    mkdir -p "$tmp/run$n" "$tmp/config$n"
+    chmod 700 "$tmp/run$n"
+
+    Xvfb -displayfd 3 -screen 0 1920x1080x24 -nolisten tcp 3>"$tmp/display" 2>/dev/null &
+    xvfb_pid=$!
+    for _ in $(seq 50); do
+        [ -s "$tmp/display" ] && break
+        sleep 0.1
+    done
+    display=":$(cat "$tmp/display")"
+
+    XDG_RUNTIME_DIR="$tmp/run$n" XDG_CONFIG_HOME="$tmp/config$n" DISPLAY=$display "$berry" &
+    berry_pid=$!
+    for _ in $(seq 50); do
+        [ -S "$tmp/run$n/berry-$display.sock" ] && break
+        sleep 0.1
+    done
+
+    DISPLAY=$display "$tmp/replay" -n "$passes" "$trace" > "$tmp/report$n"
+    status=$?
+    kill $berry_pid $xvfb_pid
+    wait $berry_pid $xvfb_pid 2>/dev/null
+    if [ $status -ne 0 ]; then
+        echo "replay failed against $berry" >&2
+        exit 1
+    fi
+done
+
+if [ $n -eq 1 ]; then
+    cat "$tmp/report1"
+    exit 0
+fi
+
+# Join the reports on the operation name, the first build is the baseline
+awk -F'\t' -v builds="$*" '
+    FNR == 1 { file++; next }
+    file == 1 { order[++count] = $1 }
+    { split($2, f, " "); median[$1, file] = f[2] }
+    END {
+        printf "# median_us per build: %s\n", builds
+        for (i = 1; i <= count; i++) {
+            op = order[i]
+            line = op
+            for (j = 1; j <= file; j++)
+                line = line "\t" median[op, j]
+            for (j = 2; j <= file; j++)
+                if (median[op, 1] > 0)
+                    line = line sprintf("\t%+.1f%%", 100 * (median[op, j] - median[op, 1]) / median[op, 1])
+            print line
+        }
+    }' $(for i in $(seq $n); do echo "$tmp/report$i"; done)
@@ -4,9 +4,12 @@
 #include "config.h"
 
 #include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+#include <regex.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "globals.h"
 #include "ipc.h"
 
 struct client_geom {
@@ -17,24 +20,196 @@ struct client {
     Window window, dec;
     int ws, x_hide;
     bool decorated, hidden, fullscreen, mono, was_fs;
+    bool title_dirty; /* _NET_WM_NAME changed since the title was fetched */
+    unsigned long title_time; /* ms, last title fetch */
     struct client_geom geom;
     struct client_geom prev;
     struct client *next, *f_next;
     char title[512];
+    char status[STATUS_MAX]; /* last published BERRY_WINDOW_STATUS */
+    Time status_time;
+    unsigned long seq; /* creation order, keeps layouts stable across focus changes */
+    int layer; /* LayerBelow, LayerNormal or LayerAbove, see client_layer */
+};
+
+/* Stacking layers, each client list is ordered from the highest layer down */
+enum layer {
+    LayerBelow,
+    LayerNormal,
+    LayerAbove,
+    LayerFullscreen,
 };
 
 struct config {
-    int b_width, i_width, t_height, top_gap, bot_gap, left_gap, right_gap, r_step, m_step, focus_button, move_button, move_mask, resize_button, resize_mask, pointer_interval;
+    int b_width, i_width, t_height, top_gap, bot_gap, left_gap, right_gap, r_step, m_step, focus_button, move_button, move_mask, resize_button, resize_mask, pointer_interval, status_interval, title_interval, slow_threshold, snap_distance;
     unsigned long bf_color, bu_color, if_color, iu_color;
     bool focus_new, focus_motion, edge_lock, t_center, smart_place, draw_text, json_status, decorate, fs_remove_dec, fs_max;
-    bool follow_pointer, focus_on_click, warp_pointer;
+    bool follow_pointer, focus_on_click, warp_pointer, auto_layout, edge_snap;
     bool manage[WindowLast];
 };
 
+/* Window properties a rule can match on */
+enum rule_field {
+    RuleClass,
+    RuleInstance,
+    RuleTitle,
+    RuleFieldLast
+};
+
+enum rule_match_kind {
+    MatchAny,
+    MatchExact,
+    MatchRegex,
+};
+
+struct rule_match {
+    enum rule_match_kind kind;
+    char *str; /* MatchExact */
+    regex_t re; /* MatchRegex, compiled when the rule is added */
+};
+
+/* What a rule does to a new window, -1 or an empty geom_mask leave the
+ * default behaviour
+ */
+struct rule_action {
+    int ws, mon, decorate, fullscreen, focus;
+    int geom_mask, x, y; /* as returned by XParseGeometry */
+    unsigned int width, height;
+};
+
+struct rule {
+    char *spec; /* as given, written to the restart state */
+    struct rule_match match[RuleFieldLast];
+    int type; /* WindowType, WindowLast for normal windows, -1 for any */
+    struct rule_action action;
+    unsigned long seq; /* later rules override earlier ones */
+    struct rule *next; /* in its class bucket or the pattern list */
+    struct rule *after; /* next rule in definition order */
+};
+
+/* A key grabbed by berry itself, running a berryc command in-process. The
+ * command is packed once when the binding is added.
+ */
+struct binding {
+    char *spec; /* as given, written to the restart state */
+    KeySym sym;
+    unsigned int mods;
+    KeyCode code; /* 0 while the keysym is not on the keyboard */
+    long data[5];
+    char *str; /* string argument of the command, if any */
+    struct binding *next; /* bindings of the same keycode */
+    struct binding *after; /* next binding in definition order */
+};
+
+/* A frame or monitor edge windows snap to. pos is the x of a vertical
+ * edge or the y of a horizontal one, which spans [from, to) along the
+ * other axis.
+ */
+struct edge {
+    int pos, from, to;
+};
+
+/* The edges of one monitor, each array sorted by pos */
+struct edge_index {
+    struct edge *v, *h;
+    int nv, nh, cap;
+    bool dirty;
+};
+
+/* A query received over X, answered once the pass of run() is done */
+struct query_pending {
+    long kind;
+    Window window;
+};
+
+/* Growable string used to serialize state for IPC replies */
+struct strbuf {
+    char *data;
+    size_t len, cap;
+};
+
+/* A deferred callback, queued on a timer_wheel with timer_add. Timers are
+ * owned by their users, the wheel only links them.
+ */
+struct timer {
+    unsigned long expires; /* tick at which fn runs */
+    void (*fn)(void *arg);
+    void *arg;
+    struct timer *next, **pprev; /* pprev is NULL while not queued */
+};
+
+/* Hierarchical timer wheel: level 0 holds the next 64 ticks one per slot,
+ * each further level 64 times as many per slot. Timers move down a level
+ * whenever the level below wraps around.
+ */
+struct timer_wheel {
+    unsigned long now; /* next tick to run */
+    unsigned int count;
+    struct timer *slots[TIMER_WHEEL_LEVELS][1 << TIMER_WHEEL_BITS];
+};
+
+enum drag_mode {
+    DragNone,
+    DragMove,
+    DragResize,
+};
+
+/* A move or resize with the mouse. The event handlers only record the
+ * pointer, run() applies the last position once per batch of events.
+ */
+struct drag {
+    struct client *client; /* NULL while no drag is in progress */
+    enum drag_mode mode;
+    unsigned int button;
+    int x, y; /* pointer at the button press */
+    struct client_geom geom; /* frame at the button press */
+    int px, py; /* last pointer position, applied when pending */
+    bool pending;
+    Time time; /* of the last motion event */
+    unsigned long applied; /* ms, when a position was last applied */
+};
+
+/* Event sources watched by the event loop, stored as their epoll data */
+enum source {
+    SourceX,
+    SourceTimer,
+    SourceSignal,
+    SourceIPC,
+    SourceLog,
+    SourceConn, /* SourceConn + i for ipc_conns[i] */
+};
+
+struct ipc_conn {
+    int fd;
+    unsigned int watched; /* epoll events registered for fd */
+    unsigned int events; /* mask of subscribed IPCEvents */
+    size_t len;
+    char buf[sizeof(struct ipc_frame) + IPC_STRING_MAX];
+    struct strbuf out; /* replies and events not yet written */
+};
+
 struct monitor {
     int x, y, width, height, screen;
 };
 
+/* A property write handed to the publishing worker. data is owned by the
+ * queue entry, a window of None asks the worker to stop.
+ */
+struct publish {
+    Window window;
+    Atom property, type;
+    int format, n;
+    unsigned char *data;
+};
+
+/* An opened font, kept after its last user released it until evicted */
+struct font_cache {
+    char name[MAXLEN];
+    XftFont *font;
+    unsigned int refs;
+    unsigned long used; /* font_clock at the last acquire */
+};
+
 enum atoms_net {
     NetSupported,
     NetNumberOfDesktops,
@@ -43,6 +218,7 @@ enum atoms_net {
     NetClientList,
     NetWMStateFullscreen,
     NetWMStateBelow,
+    NetWMStateAbove,
     NetWMCheck,
     NetWMState,
     NetWMName,
@@ -73,9 +249,54 @@ enum berry_net {
     BerryWindowStatus,
     BerryClientEvent,
     BerryFontProperty,
+    BerryStats,
+    BerryQueryReply,
     BerryLast
 };
 
+enum stat_round_trip {
+    StatGetWindowProperty,
+    StatQueryPointer,
+    StatGetWindowAttributes,
+    StatGetWMProtocols,
+    StatQueryColor,
+    StatGetModifierMapping,
+    StatLast
+};
+
+struct stats {
+    unsigned long events[LASTEvent], requests[LASTEvent];
+    unsigned long ipc[IPCLast], ipc_requests[IPCLast];
+    unsigned long round_trips[StatLast];
+    int queue_max;
+};
+
+/* One handled X event or IPC command in the flight recorder */
+struct record {
+    unsigned long time;     /* start, us since an arbitrary point */
+    unsigned long window;   /* event window, or focused client for IPC */
+    unsigned int duration;  /* us */
+    unsigned short type;    /* X event type, IPC command | RECORD_IPC or record_work | RECORD_WORK */
+    unsigned short requests;
+    unsigned short round_trips;
+};
+
+/* Work run once per batch of events, recorded like a handler */
+enum record_work {
+    WorkMonitorsUpdate,
+    WorkRefreshConfig,
+    WorkLast
+};
+
+/* Settings changed since the last refresh_config */
+enum config_dirty {
+    DirtyLayout = 1 << 0, /* border, inner border or title sizes */
+    DirtyColor  = 1 << 1, /* border and inner colors */
+    DirtyText   = 1 << 2, /* title font, color or visibility */
+    DirtyGaps   = 1 << 3, /* edge gaps or edge lock, visible clients are clamped */
+    DirtyStatus = 1 << 4, /* BERRY_WINDOW_STATUS format */
+};
+
 enum direction {
     EAST,
     NORTH,
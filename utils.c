@@ -1,6 +1,23 @@
 #include "utils.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* A debug log record. Messages without arguments keep a pointer to their
+ * string literal, formatted ones are formatted right away since their
+ * arguments may not outlive the call.
+ */
+struct log_entry {
+	const char *msg;
+	char text[LOG_TEXT_MAX];
+};
+
+static struct log_entry log_ring[LOG_RING_SIZE];
+static unsigned long log_head = 0, log_tail = 0, log_dropped = 0;
+static char log_out[PIPE_BUF]; /* records being written to stderr */
+static size_t log_out_len = 0, log_out_off = 0;
 
 int
 asprintf(char **buf, const char *fmt, ...)
@@ -34,3 +51,347 @@ vasprintf(char **buf, const char *fmt, va_list args)
 	size = vsprintf(*buf, fmt, args);
 	return size;
 }
+
+/* Append formatted text to the given strbuf, growing it as required.
+ * The buffer is always NUL terminated.
+ */
+int
+strbuf_printf(struct strbuf *sb, const char *fmt, ...)
+{
+	int size;
+	va_list args;
+
+	va_start(args, fmt);
+	size = vsnprintf(sb->data ? sb->data + sb->len : NULL,
+			sb->data ? sb->cap - sb->len : 0, fmt, args);
+	va_end(args);
+
+	if (size < 0)
+		return -1;
+
+	if (sb->data == NULL || sb->len + size >= sb->cap) {
+		size_t cap = sb->cap ? sb->cap : 256;
+		char *tmp;
+
+		while (sb->len + size >= cap)
+			cap *= 2;
+
+		tmp = realloc(sb->data, cap);
+		if (tmp == NULL)
+			return -1;
+
+		sb->data = tmp;
+		sb->cap = cap;
+
+		va_start(args, fmt);
+		vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, args);
+		va_end(args);
+	}
+
+	sb->len += size;
+	return size;
+}
+
+/* Append raw bytes, used for binary IPC replies */
+int
+strbuf_append(struct strbuf *sb, const void *data, size_t len)
+{
+	if (sb->data == NULL || sb->len + len >= sb->cap) {
+		size_t cap = sb->cap ? sb->cap : 256;
+		char *tmp;
+
+		while (sb->len + len >= cap)
+			cap *= 2;
+
+		tmp = realloc(sb->data, cap);
+		if (tmp == NULL)
+			return -1;
+
+		sb->data = tmp;
+		sb->cap = cap;
+	}
+
+	memcpy(sb->data + sb->len, data, len);
+	sb->len += len;
+	sb->data[sb->len] = '\0';
+	return len;
+}
+
+/* Append str as a quoted JSON string, escaping quotes, backslashes and
+ * control characters. Other bytes, including UTF-8 sequences, are copied.
+ */
+int
+strbuf_json_string(struct strbuf *sb, const char *str)
+{
+	const char *start = str;
+
+	if (strbuf_append(sb, "\"", 1) < 0)
+		return -1;
+
+	for (; *str != '\0'; str++) {
+		unsigned char ch = *str;
+
+		if (ch >= 0x20 && ch != '"' && ch != '\\')
+			continue;
+		strbuf_append(sb, start, str - start);
+		if (ch == '"' || ch == '\\')
+			strbuf_printf(sb, "\\%c", ch);
+		else
+			strbuf_printf(sb, "\\u%04x", ch);
+		start = str + 1;
+	}
+	strbuf_append(sb, start, str - start);
+
+	return strbuf_append(sb, "\"", 1);
+}
+
+void
+strbuf_free(struct strbuf *sb)
+{
+	free(sb->data);
+	memset(sb, 0, sizeof *sb);
+}
+
+/* Copy the UTF-8 string src into dst of the given size. A string which
+ * does not fit is cut before the sequence that would be split, so dst
+ * never ends in a partial character.
+ */
+void
+utf8_copy(char *dst, const char *src, size_t size)
+{
+	size_t n = strlen(src);
+
+	if (size == 0)
+		return;
+	if (n >= size) {
+		n = size - 1;
+		while (n > 0 && ((unsigned char)src[n] & 0xc0) == 0x80)
+			n--;
+	}
+	memcpy(dst, src, n);
+	dst[n] = '\0';
+}
+
+/* Take the next slot of the log ring, overwriting the oldest record when
+ * the ring is full.
+ */
+static struct log_entry *
+log_slot(void)
+{
+	if (log_head - log_tail == LOG_RING_SIZE) {
+		log_tail++;
+		log_dropped++;
+	}
+	return &log_ring[log_head++ & (LOG_RING_SIZE - 1)];
+}
+
+void
+log_message(const char *msg)
+{
+	log_slot()->msg = msg;
+}
+
+void
+log_printf(const char *fmt, ...)
+{
+	struct log_entry *e = log_slot();
+	va_list args;
+
+	e->msg = NULL;
+	va_start(args, fmt);
+	if (vsnprintf(e->text, sizeof e->text, fmt, args) >= (int)sizeof e->text)
+		e->text[sizeof e->text - 2] = '\n';
+	va_end(args);
+}
+
+int
+log_pending(void)
+{
+	return log_tail != log_head || log_out_off != log_out_len || log_dropped > 0;
+}
+
+/* Write as many whole records to fd as fit into one PIPE_BUF sized write,
+ * so that a ready pipe never blocks the caller. Returns 1 while records
+ * are left, 0 once the ring is empty and -1 if fd cannot be written.
+ */
+int
+log_flush(int fd)
+{
+	ssize_t n;
+
+	if (log_out_off == log_out_len) {
+		log_out_off = log_out_len = 0;
+		if (log_dropped > 0) {
+			log_out_len = snprintf(log_out, sizeof log_out, "%s: %lu log records dropped\n",
+					__WINDOW_MANAGER_NAME__, log_dropped);
+			log_dropped = 0;
+		}
+		while (log_tail != log_head) {
+			struct log_entry *e = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+			const char *s = e->msg ? e->msg : e->text;
+			size_t len = MIN(strlen(s), sizeof log_out);
+
+			if (log_out_len + len > sizeof log_out)
+				break;
+			memcpy(log_out + log_out_len, s, len);
+			log_out_len += len;
+			log_tail++;
+		}
+	}
+
+	n = write(fd, log_out + log_out_off, log_out_len - log_out_off);
+	if (n < 0)
+		return -1;
+	log_out_off += n;
+
+	return log_pending();
+}
+
+#define TIMER_SLOTS (1ul << TIMER_WHEEL_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+void
+timer_wheel_init(struct timer_wheel *w, unsigned long now)
+{
+	memset(w, 0, sizeof *w);
+	w->now = now;
+}
+
+/* Link t into the slot of the lowest level which covers its expiry */
+static void
+timer_link(struct timer_wheel *w, struct timer *t)
+{
+	unsigned long delta = t->expires - w->now;
+	struct timer **slot;
+	int level = 0;
+
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ul << (TIMER_WHEEL_BITS * (level + 1)))
+		level++;
+	slot = &w->slots[level][(t->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_MASK];
+
+	t->next = *slot;
+	if (t->next != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void
+timer_unlink(struct timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* Queue t to run once the wheel reaches tick expires, past ticks run with
+ * the next timer_run. A queued timer is moved.
+ */
+void
+timer_add(struct timer_wheel *w, struct timer *t, unsigned long expires)
+{
+	unsigned long max = (1ul << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+	timer_del(w, t);
+	if ((long)(expires - w->now) < 0)
+		expires = w->now;
+	else if (expires - w->now > max)
+		expires = w->now + max;
+	t->expires = expires;
+	timer_link(w, t);
+	w->count++;
+}
+
+void
+timer_del(struct timer_wheel *w, struct timer *t)
+{
+	if (t->pprev == NULL)
+		return;
+	timer_unlink(t);
+	w->count--;
+}
+
+int
+timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+/* Move the timers of the current slot of level down to the lower levels.
+ * Called as the level below wraps, continues upwards if this one wraps too.
+ */
+static void
+timer_cascade(struct timer_wheel *w, int level)
+{
+	unsigned long idx;
+	struct timer *t;
+
+	if (level >= TIMER_WHEEL_LEVELS)
+		return;
+	idx = (w->now >> (TIMER_WHEEL_BITS * level)) & TIMER_MASK;
+	if (idx == 0)
+		timer_cascade(w, level + 1);
+
+	while ((t = w->slots[level][idx]) != NULL) {
+		timer_unlink(t);
+		timer_link(w, t);
+	}
+}
+
+/* Run every timer due up to and including tick now. A callback may add and
+ * delete timers, including itself.
+ */
+void
+timer_run(struct timer_wheel *w, unsigned long now)
+{
+	while ((long)(now - w->now) >= 0) {
+		struct timer **slot;
+		struct timer *t;
+
+		if (w->count == 0) {
+			w->now = now + 1;
+			break;
+		}
+		if ((w->now & TIMER_MASK) == 0)
+			timer_cascade(w, 1);
+
+		slot = &w->slots[0][w->now & TIMER_MASK];
+		while ((t = *slot) != NULL) {
+			timer_unlink(t);
+			w->count--;
+			t->fn(t->arg);
+		}
+		w->now++;
+	}
+}
+
+/* Ticks until timer_run next has work to do, either a timer to run or a
+ * slot to cascade, or -1 if no timer is queued.
+ */
+long
+timer_next(const struct timer_wheel *w)
+{
+	long next = -1;
+
+	if (w->count == 0)
+		return -1;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		int shift = TIMER_WHEEL_BITS * level;
+		/* first tick from now on at which this level's slot changes */
+		unsigned long base = (w->now + (1ul << shift) - 1) >> shift;
+
+		for (unsigned long k = 0; k < TIMER_SLOTS; k++) {
+			if (w->slots[level][(base + k) & TIMER_MASK] != NULL) {
+				long at = (long)(((base + k) << shift) - w->now);
+				if (next < 0 || at < next)
+					next = at;
+				break;
+			}
+		}
+	}
+
+	return next;
+}
@@ -3,14 +3,39 @@
 
 #include "types.h"
 #include <stdarg.h>
+#include <stddef.h>
 
 #define MAX(a, b) ((a > b) ? (a) : (b))
 #define MIN(a, b) ((a < b) ? (a) : (b))
 #define UNUSED(x) (void)(x)
-#define LOGN(msg)      do { if (debug) fprintf(stderr, __WINDOW_MANAGER_NAME__": " msg "\n"); } while (0)
-#define LOGP(msg, ...) do { if (debug) fprintf(stderr, __WINDOW_MANAGER_NAME__": " msg "\n", __VA_ARGS__); } while (0)
+
+/* Debug logging is compiled out of release builds. In debug builds records
+ * go to an in-memory ring which the event loop drains to stderr when idle.
+ */
+#ifdef NDEBUG
+#define LOGN(msg)      do { if (0) log_message(msg); } while (0)
+#define LOGP(msg, ...) do { if (0) log_printf(msg, __VA_ARGS__); } while (0)
+#else
+#define LOGN(msg)      do { if (debug) log_message(__WINDOW_MANAGER_NAME__": " msg "\n"); } while (0)
+#define LOGP(msg, ...) do { if (debug) log_printf(__WINDOW_MANAGER_NAME__": " msg "\n", __VA_ARGS__); } while (0)
+#endif
 
 int asprintf(char **buf, const char *fmt, ...);
 int vasprintf(char **buf, const char *fmt, va_list args);
+int strbuf_printf(struct strbuf *sb, const char *fmt, ...);
+int strbuf_append(struct strbuf *sb, const void *data, size_t len);
+int strbuf_json_string(struct strbuf *sb, const char *str);
+void strbuf_free(struct strbuf *sb);
+void utf8_copy(char *dst, const char *src, size_t size);
+void log_message(const char *msg);
+void log_printf(const char *fmt, ...);
+int log_pending(void);
+int log_flush(int fd);
+void timer_wheel_init(struct timer_wheel *w, unsigned long now);
+void timer_add(struct timer_wheel *w, struct timer *t, unsigned long expires);
+void timer_del(struct timer_wheel *w, struct timer *t);
+int timer_pending(const struct timer *t);
+void timer_run(struct timer_wheel *w, unsigned long now);
+long timer_next(const struct timer_wheel *w);
 
 #endif
@@ -3,13 +3,24 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <X11/Xatom.h>
@@ -17,8 +28,10 @@
 #include <X11/Xproto.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/Xinerama.h>
+#include <X11/extensions/Xrandr.h>
 #include <X11/extensions/shape.h>
 #include <X11/cursorfont.h>
+#include <X11/keysym.h>
 #include <X11/Xft/Xft.h>
 
 #include "globals.h"
@@ -31,23 +44,85 @@ static struct client *c_list[WORKSPACE_NUMBER]; /* 'stack' of managed clients in
 static struct client *f_list[WORKSPACE_NUMBER]; /* ordered lists for clients to be focused */
 static struct monitor *m_list = NULL; /* All saved monitors */
 static struct config conf; /* global config */
+static struct stats stats; /* runtime counters, see BERRY_STATS */
 static int ws_m_list[WORKSPACE_NUMBER]; /* Mapping from workspaces to associated monitors */
 static int curr_ws = 0;
 static int m_count = 0;
+static int randr_base = -1; /* RandR event base, -1 when monitors come from Xinerama */
+static bool monitors_dirty = false; /* monitor layout changed since the last monitors_update */
+static int ws_layout[WORKSPACE_NUMBER]; /* LayoutKind of each workspace */
+static bool layout_pending[WORKSPACE_NUMBER]; /* layout deferred until the workspace is shown */
+static unsigned long client_seq = 0;
+static bool titles_dirty = false; /* some client has title_dirty set */
+
+/* Publishing worker: a thread with its own connection which performs the
+ * property writes nothing in berry reads back, see publish()
+ */
+static Display *pub_display = NULL;
+static pthread_t pub_thread;
+static int pub_pipe[2] = { -1, -1 }; /* wakes the worker */
+static struct publish pub_queue[PUBLISH_QUEUE_SIZE];
+static unsigned long pub_head = 0, pub_tail = 0; /* written by berry and the worker */
+static bool pub_queued = false; /* entries queued since the last wakeup */
+static struct record record[RECORD_SIZE]; /* flight recorder, see record_add */
+static unsigned long record_head = 0;
+static unsigned long record_dumped = 0; /* time of the last dump */
+static bool record_dump_pending = false;
+static struct drag drag = { .client = NULL, .mode = DragNone }; /* see drag_start */
+static struct edge_index *edge_index = NULL; /* per monitor, see edges_get */
+static int edge_index_count = 0;
 static Cursor move_cursor, normal_cursor;
 static Display *display = NULL;
 static Atom net_atom[NetLast], wm_atom[WMLast], net_berry[BerryLast];
 static Window root, check, nofocus;
 static bool running = true;
+static bool restarting = false; /* exec a new instance once the event loop stops */
+static int restore_fd = -1; /* state handed over by the instance we restarted from */
+static char **berry_argv;
+static unsigned int config_dirty = 0; /* settings changed since the last refresh_config */
 static bool debug = false;
 static int screen, display_width, display_height;
 static int (*xerrorxlib)(Display *, XErrorEvent *);
 static XftColor xft_focus_color, xft_unfocus_color;
 static XftFont *font;
 static char global_font[MAXLEN] = DEFAULT_FONT;
+static struct font_cache font_cache[FONT_CACHE_SIZE];
+static unsigned long font_clock = 0;
 static XRenderColor r_color;
 static GC gc;
 static Atom utf8string;
+static int ipc_fd = -1; /* listening socket for socket IPC */
+static char ipc_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static struct ipc_conn ipc_conns[IPC_MAX_CONNS];
+static struct rule *rule_table[RULE_BUCKETS]; /* rules matching an exact class */
+static struct rule *rule_patterns = NULL; /* every other rule */
+static struct rule *rule_list = NULL, **rule_last = &rule_list; /* in definition order */
+static unsigned long rule_seq = 0;
+static const struct rule_action rule_action_none = { -1, -1, -1, -1, -1, 0, 0, 0, 0, 0 }; /* -1: left alone */
+static struct binding *binding_table[KEYCODE_MAX]; /* key bindings by keycode */
+static struct query_pending query_queue[QUERY_PENDING]; /* see ipc_query */
+static int query_count = 0;
+static struct binding *binding_list = NULL, **binding_last = &binding_list; /* in definition order */
+static unsigned int numlock_mask = 0; /* ignored in key bindings like LockMask */
+static bool grab_failed = false; /* a key grab was refused, see binding_grab */
+static const char *const work_names[WorkLast] = {
+    [WorkMonitorsUpdate] = "monitors_update",
+    [WorkRefreshConfig] = "refresh_config",
+};
+static const char *const window_type_names[WindowLast] = {
+    [Dock] = "Dock", [Dialog] = "Dialog", [Toolbar] = "Toolbar",
+    [Menu] = "Menu", [Splash] = "Splash", [Utility] = "Utility",
+};
+
+/* Event loop, see run() */
+static int reactor_fd = -1; /* epoll instance watching every enum source */
+static int timer_fd = -1; /* armed for the next due timer of the wheel */
+static int signal_fd = -1;
+static int log_watch = 0; /* 1 while stderr is watched, -1 if epoll refuses it */
+static sigset_t reactor_signals; /* handled through signal_fd */
+static struct timer_wheel timers; /* deferred work, in ms */
+static struct timer title_timer; /* wakes run() for held back titles */
+static struct timer drag_timer; /* wakes run() for a motion held back by pointer_interval */
 
 /* All functions */
 
@@ -67,6 +142,11 @@ static void client_move_absolute(struct client *c, int x, int y);
 static void client_move_relative(struct client *c, int x, int y);
 static void client_move_to_front(struct client *c);
 static void client_monocle(struct client *c);
+static void client_configure(struct client *c);
+static void client_move_resize(struct client *c, int x, int y, int w, int h);
+static void layout_apply(int ws);
+static void layout_changed(int ws);
+static int layout_split(int length, int n, int i);
 static void client_place(struct client *c);
 static void client_raise(struct client *c);
 static void client_refresh(struct client *c);
@@ -77,16 +157,22 @@ static void client_send_to_ws(struct client *c, int ws);
 static void client_set_color(struct client *c, unsigned long i_color, unsigned long b_color);
 static void client_set_input(struct client *c);
 static void client_set_title(struct client *c);
+static void client_title_refresh(struct client *c, unsigned long now);
+static int titles_refresh(void);
 static void client_show(struct client *c);
 static void client_snap_left(struct client *c);
 static void client_snap_right(struct client *c);
 static void client_toggle_decorations(struct client *c);
 static void client_set_status(struct client *c);
+static const char *client_state(struct client *c);
 static void client_set_wm_state(struct client *c, unsigned long state);
-static bool client_window_is_below(struct client *c);
+static int client_layer(struct client *c);
+static void client_set_layer(struct client *c, int layer);
+static void client_stack_insert(struct client *c);
+static int window_get_layer(Window w);
 
 /* EWMH functions */
-static void ewmh_set_fullscreen(struct client *c, bool fullscreen);
+static void ewmh_set_state(struct client *c);
 static void ewmh_set_viewport(void);
 static void ewmh_set_focus(struct client *c);
 static void ewmh_set_desktop(struct client *c, int ws);
@@ -94,7 +180,6 @@ static void ewmh_set_frame_extents(struct client *c);
 static void ewmh_set_client_list(void);
 static void ewmh_set_desktop_names(void);
 static void ewmh_set_active_desktop(int ws);
-static void ewmh_set_below(struct client *c, bool below);
 
 /* Event handlers */
 static void handle_client_message(XEvent *e);
@@ -104,6 +189,10 @@ static void handle_focus(XEvent *e);
 static void handle_map_request(XEvent *e);
 static void handle_unmap_notify(XEvent *e);
 static void handle_button_press(XEvent *e);
+static void handle_button_release(XEvent *e);
+static void handle_motion_notify(XEvent *e);
+static void handle_key_press(XEvent *e);
+static void handle_mapping_notify(XEvent *e);
 static void handle_expose(XEvent *e);
 static void handle_property_notify(XEvent *e);
 static void handle_enter_notify(XEvent *e);
@@ -133,23 +222,117 @@ static void ipc_config(long *d);
 static void ipc_save_monitor(long *d);
 static void ipc_set_font(long *d);
 static void ipc_edge_gap(long *d);
-
-static void monitors_free(void);
-static void monitors_setup(void);
+static void ipc_dump_stats(long *d);
+static void ipc_restart(long *d);
+static void ipc_layout(long *d);
+static void ipc_dump_record(long *d);
+static void ipc_clear_rules(long *d);
+static void ipc_clear_bindings(long *d);
+static int ipc_query(long *d, struct strbuf *reply);
+static int ipc_command(long *d, const char *str, struct strbuf *reply);
+static void query_serialize(int kind, struct strbuf *sb);
+static void query_write(long kind, Window w);
+static void queries_answer(void);
+static void query_client(struct client *c, struct strbuf *sb);
+
+/* Socket IPC functions */
+static void ipc_socket_setup(void);
+static void ipc_socket_close(void);
+static void ipc_socket_accept(void);
+static void ipc_conn_close(struct ipc_conn *conn);
+static void ipc_conn_read(struct ipc_conn *conn);
+static void ipc_conn_queue(struct ipc_conn *conn, const void *data, size_t len);
+static void ipc_conn_flush(struct ipc_conn *conn);
+static bool ipc_event_begin(int event, struct strbuf *sb);
+static void ipc_event_end(int event, struct strbuf *sb);
+static void ipc_event_client(int event, struct client *c);
+static void ipc_event_workspace(int ws);
+static void ipc_event_config(long *d);
+
+static unsigned long record_now(void);
+static void record_add(unsigned int type, unsigned long window, unsigned long start, unsigned long requests, unsigned long round_trips);
+static void record_work(enum record_work work, void (*fn)(void));
+static unsigned long stats_round_trips(void);
+static void record_dump(void);
+
+static void publish(Window w, Atom property, Atom type, int format, const void *data, int n);
+static void publish_start(void);
+static void publish_stop(void);
+static void publish_wakeup(void);
+static void publish_reserve(void);
+static void *publish_worker(void *arg);
+
+static void randr_setup(void);
+static int monitors_query(struct monitor **list);
+static void monitors_update(void);
+static void edges_invalidate(void);
+static void edges_touch(struct client *c);
+static struct edge_index *edges_get(int mon);
+static void edges_add(struct edge_index *idx, int x, int y, int w, int h);
+static int edge_cmp(const void *a, const void *b);
+static void edge_nearest(const struct edge *e, int n, int pos, int from, int to, int *best);
+static void edge_snap_move(struct client *c, int *x, int *y);
+static void edge_snap_resize(struct client *c, int *w, int *h);
+static void drag_start(struct client *c, XButtonPressedEvent *bev, int x, int y);
+static void drag_update(void);
+static void drag_stop(bool restore);
+static void client_monitor_clamp(struct client *c);
+static void handle_randr_notify(XEvent *e);
 
 static void close_wm(void);
+static void desktop_name_set(int ws, const char *name);
 static void draw_text(struct client *c, bool focused);
+static bool font_set(const char *name);
+static XftFont *font_acquire(const char *name);
+static void font_release(XftFont *f);
+static void font_cache_free(void);
 static struct client* get_client_from_window(Window w);
 static void load_color(XftColor *dest_color, unsigned long raw_color);
 static void load_config(char *conf_path);
-static void manage_new_window(Window w, XWindowAttributes *wa);
+static void load_settings(const char *path);
+static void settings_line(const char *path, int lineno, char *line);
+static void settings_write(FILE *f);
+static void settings_quote(FILE *f, const char *str);
+static void state_write(FILE *f);
+static bool state_restore(int fd);
+static void state_restore_client(char *line);
+static void restart(void);
+static void manage_new_window(Window w, XWindowAttributes *wa, bool adopt);
+static void manage_existing_windows(void);
+static int window_type_index(Atom type);
+static bool rule_add(const char *spec);
+static bool rule_parse(struct rule *r, const char *key, char op, const char *value);
+static void rule_free(struct rule *r);
+static void rules_clear(void);
+static unsigned int rule_hash(const char *str);
+static bool rule_match(const struct rule *r, const char *const values[RuleFieldLast], int type);
+static struct rule_action rules_apply(struct client *c, int type);
+static void rule_geometry(struct client *c, const struct rule_action *a);
+static bool binding_add(const char *spec);
+static bool binding_parse_key(struct binding *b, char *key);
+static bool binding_grab(struct binding *b);
+static void binding_free(struct binding *b);
+static void bindings_grab(void);
+static void bindings_clear(void);
+static void numlock_update(void);
+static int monitor_workspace(int mon);
+static int window_get_desktop(Window w);
 static int manage_xsend_icccm(struct client *c, Atom atom);
 static void window_grab_buttons(Window window);
 static void window_ungrab_buttons(Window window);
 static void grab_buttons(void);
 static void ungrab_buttons(void);
 static void refresh_config(void);
+static void client_relayout(struct client *c);
 static void run(void);
+static void run_x_events(void);
+static void reactor_setup(void);
+static int reactor_ctl(int op, int fd, unsigned int events, unsigned int source);
+static void reactor_arm(void);
+static void reactor_watch_output(void);
+static void reactor_signal(void);
+static void reactor_dispatch(struct epoll_event *ev);
+static void timer_wake(void *arg);
 static bool safe_to_focus(int ws);
 static void setup(void);
 static void switch_ws(int ws);
@@ -178,6 +361,10 @@ static const x11_event_handler_t event_handler [LASTEvent] = {
     [ConfigureRequest] = handle_configure_request,
     [ClientMessage]    = handle_client_message,
     [ButtonPress]      = handle_button_press,
+    [ButtonRelease]    = handle_button_release,
+    [MotionNotify]     = handle_motion_notify,
+    [KeyPress]         = handle_key_press,
+    [MappingNotify]    = handle_mapping_notify,
     [PropertyNotify]   = handle_property_notify,
     [Expose]           = handle_expose,
     [FocusIn]          = handle_focus,
@@ -208,6 +395,12 @@ static const ipc_event_handler_t ipc_handler [IPCLast] = {
     [IPCSaveMonitor]              = ipc_save_monitor,
     [IPCSetFont]                  = ipc_set_font,
     [IPCEdgeGap]                  = ipc_edge_gap,
+    [IPCDumpStats]                = ipc_dump_stats,
+    [IPCRestart]                  = ipc_restart,
+    [IPCLayout]                   = ipc_layout,
+    [IPCDumpRecord]               = ipc_dump_record,
+    [IPCClearRules]               = ipc_clear_rules,
+    [IPCClearBindings]            = ipc_clear_bindings,
     [IPCConfig]                   = ipc_config
 };
 
@@ -309,6 +502,8 @@ close_wm(void)
 {
     LOGN("Shutting down window manager");
 
+    ipc_socket_close();
+
     for (int i = 0; i < WORKSPACE_NUMBER; i++) {
         while (c_list[i] != NULL)
             client_delete(c_list[i]);
@@ -317,10 +512,17 @@ close_wm(void)
 
     XDeleteProperty(display, root, net_berry[BerryWindowStatus]);
     XDeleteProperty(display, root, net_berry[BerryFontProperty]);
+    XDeleteProperty(display, root, net_berry[BerryStats]);
     XDeleteProperty(display, root, net_atom[NetSupported]);
 
+    font_cache_free();
+    rules_clear();
+    bindings_clear();
+    publish_stop();
     LOGN("Closing display...");
     XCloseDisplay(display);
+    while (log_flush(STDERR_FILENO) > 0)
+        ;
 }
 
 static void
@@ -443,6 +645,11 @@ client_delete(struct client *c)
         LOGP("Deleting client on workspace %d", ws);
     }
 
+    if (c == drag.client)
+        drag_stop(false);
+
+    ipc_event_client(EventUnmap, c);
+
     /* Delete in the stack */
     if (c_list[ws] == c) {
         c_list[ws] = c_list[ws]->next;
@@ -472,16 +679,19 @@ client_delete(struct client *c)
     if (c_list[ws] == NULL)
         f_client = NULL;
 
+    edges_touch(c);
     client_set_wm_state(c, WithdrawnState);
     ewmh_set_client_list();
 }
 
-static void
-monitors_free(void)
-{
-    free(m_list);
-    m_list = NULL;
-}
+static const char *stat_round_trip_names[StatLast] = {
+    [StatGetWindowProperty]   = "XGetWindowProperty",
+    [StatQueryPointer]        = "XQueryPointer",
+    [StatGetWindowAttributes] = "XGetWindowAttributes",
+    [StatGetWMProtocols]      = "XGetWMProtocols",
+    [StatQueryColor]          = "XQueryColor",
+    [StatGetModifierMapping]  = "XGetModifierMapping",
+};
 
 /* Set the given Client to be fullscreen. Moves the window to fill the dimensions
  * of the given display.
@@ -509,7 +719,6 @@ client_fullscreen(struct client *c, bool toggle, bool fullscreen, bool max)
 
     // TODO: FACTOR THIS SHIT
     if (to_fs) {
-        ewmh_set_fullscreen(c, true);
         if (c->decorated && conf.fs_remove_dec) { //
             client_decorations_destroy(c);
             c->was_fs = true;
@@ -524,7 +733,6 @@ client_fullscreen(struct client *c, bool toggle, bool fullscreen, bool max)
         }
         c->fullscreen = true;
     } else {
-        ewmh_set_fullscreen(c, false);
         if (max) {
             client_move_absolute(c, c->prev.x, c->prev.y);
             client_resize_absolute(c, c->prev.width, c->prev.height);
@@ -543,7 +751,12 @@ client_fullscreen(struct client *c, bool toggle, bool fullscreen, bool max)
         client_refresh(c);
     }
 
+    /* Fullscreen clients have a layer of their own */
+    ewmh_set_state(c);
+    client_move_to_front(c);
+    client_raise(c);
     client_set_status(c);
+    ipc_event_client(EventState, c);
 }
 
 /* Focus the next window in the list. Windows are sorted by the order in which they are
@@ -601,7 +814,7 @@ static void
 handle_client_message(XEvent *e)
 {
     XClientMessageEvent *cme = &e->xclient;
-    long cmd, *data;
+    long *data;
 
     if (cme->message_type == net_berry[BerryClientEvent]) {
         LOGN("Received event from berryc");
@@ -609,9 +822,7 @@ handle_client_message(XEvent *e)
 			LOGN("Wrong format, ignoring event");
 			return;
 		}
-        cmd = cme->data.l[0];
-        data = cme->data.l;
-        ipc_handler[cmd](data);
+        ipc_command(cme->data.l, NULL, NULL);
     } else if (cme->message_type == net_atom[NetWMState]) {
         struct client* c = get_client_from_window(cme->window);
         if (c == NULL) {
@@ -635,6 +846,21 @@ handle_client_message(XEvent *e)
                 client_fullscreen(c, true, true, true);
                 LOGN("type 2");
             }
+        } else {
+            /* _NET_WM_STATE_BELOW and _ABOVE, action 0 removes, 1 adds and 2 toggles */
+            for (int i = 1; i <= 2; i++) {
+                int layer;
+                if ((Atom)cme->data.l[i] == net_atom[NetWMStateBelow])
+                    layer = LayerBelow;
+                else if ((Atom)cme->data.l[i] == net_atom[NetWMStateAbove])
+                    layer = LayerAbove;
+                else
+                    continue;
+                if (cme->data.l[0] == 0 || (cme->data.l[0] == 2 && c->layer == layer))
+                    layer = LayerNormal;
+                client_set_layer(c, layer);
+                break;
+            }
         }
     } else if (cme->message_type == net_atom[NetActiveWindow]) {
         struct client *c = get_client_from_window(cme->window);
@@ -663,14 +889,15 @@ handle_button_press(XEvent *e)
      * this function.
      */
     XButtonPressedEvent *bev = &e->xbutton;
-    XEvent ev;
     struct client *c;
-    int x, y, ocx, ocy, nx, ny, nw, nh, di, ocw, och;
+    int x, y, di;
     unsigned int dui, state;
     Window dummy;
-    Time current_time, last_motion;
 
+    if (drag.client != NULL)
+        return;
     XQueryPointer(display, root, &dummy, &dummy, &x, &y, &di, &di, &dui);
+    stats.round_trips[StatQueryPointer]++;
     LOGN("Handling button press event");
     c = get_client_from_window(bev->window);
     if (c == NULL)
@@ -691,49 +918,195 @@ handle_button_press(XEvent *e)
         return;
     }
     // Otherwise process window movement or resize
-    ocx = c->geom.x;
-    ocy = c->geom.y;
-    ocw = c->geom.width;
-    och = c->geom.height;
-    last_motion = ev.xmotion.time;
-    if (XGrabPointer(display, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync, None, move_cursor, CurrentTime) != GrabSuccess)
-        return;
-    do {
-        XMaskEvent(display, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
-        switch (ev.type) {
-            case ConfigureRequest:
-            case Expose:
-            case MapRequest:
-                event_handler[ev.type](&ev);
-                break;
-            case MotionNotify:
-                current_time = ev.xmotion.time;
-                Time diff_time = current_time - last_motion;
-                if (diff_time < (Time)conf.pointer_interval) {
-                    continue;
-                }
-                last_motion = current_time;
-                state       = mod_clean(ev.xbutton.state);
-                if ((state == (unsigned)conf.move_mask && bev->button == (unsigned)conf.move_button) || ev.xbutton.state == Button1Mask) {
-                    nx = ocx + (ev.xmotion.x - x);
-                    ny = ocy + (ev.xmotion.y - y);
-                    if (conf.edge_lock)
-                        client_move_relative(c, nx - c->geom.x, ny - c->geom.y);
-                    else
-                        client_move_absolute(c, nx, ny);
-                } else if (state == (unsigned)conf.resize_mask && bev->button == (unsigned)conf.resize_button) {
-                    nw = ev.xmotion.x - x;
-                    nh = ev.xmotion.y - y;
-                    if (conf.edge_lock)
-                        client_resize_relative(c, nw - c->geom.width + ocw, nh - c->geom.height + och);
-                    else
-                        client_resize_absolute(c, ocw + nw, och + nh);
-                }
-                XFlush(display);
-                break;
-        }
-    } while (ev.type != ButtonRelease);
+    drag_start(c, bev, x, y);
+}
+
+/* Start moving or resizing c. The drag runs inside the main loop:
+ * handle_motion_notify records the pointer, drag_update applies it once
+ * per batch and handle_button_release or Escape end it.
+ */
+static void
+drag_start(struct client *c, XButtonPressedEvent *bev, int x, int y)
+{
+    unsigned int state = mod_clean(bev->state);
+
+    if (state == (unsigned)conf.move_mask && bev->button == (unsigned)conf.move_button)
+        drag.mode = DragMove;
+    else if (state == 0 && bev->button == Button1)
+        drag.mode = DragMove;
+    else if (state == (unsigned)conf.resize_mask && bev->button == (unsigned)conf.resize_button)
+        drag.mode = DragResize;
+    else {
+        /* Nothing to drag, do not leave a synchronous grab frozen */
+        XAllowEvents(display, AsyncPointer, CurrentTime);
+        return;
+    }
+
+    if (XGrabPointer(display, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync, None, move_cursor, CurrentTime) != GrabSuccess) {
+        drag.mode = DragNone;
+        return;
+    }
+    /* Only to cancel with Escape, the drag goes on without it */
+    XGrabKeyboard(display, root, False, GrabModeAsync, GrabModeAsync, CurrentTime);
+
+    LOGN("Starting drag");
+    drag.client = c;
+    drag.button = bev->button;
+    drag.x = drag.px = x;
+    drag.y = drag.py = y;
+    drag.geom = c->geom;
+    drag.pending = false;
+    drag.time = bev->time;
+    drag.applied = 0;
+    edges_invalidate(); /* the index must not hold the frame being dragged */
+}
+
+/* Apply the last pointer position of the drag, called by run() after each
+ * batch of events. Positions closer together than pointer_interval are
+ * held back on drag_timer.
+ */
+static void
+drag_update(void)
+{
+    struct client *c = drag.client;
+    unsigned long now = record_now() / 1000;
+    int nx, ny, nw, nh;
+
+    if (c->hidden) {
+        LOGN("Dragged client was hidden, stopping drag");
+        drag_stop(false);
+        return;
+    }
+    if (conf.pointer_interval > 0 && now - drag.applied < (unsigned long)conf.pointer_interval) {
+        if (!timer_pending(&drag_timer))
+            timer_add(&timers, &drag_timer, drag.applied + conf.pointer_interval);
+        return;
+    }
+    drag.pending = false;
+    drag.applied = now;
+
+    if (drag.mode == DragMove) {
+        nx = drag.geom.x + (drag.px - drag.x);
+        ny = drag.geom.y + (drag.py - drag.y);
+        if (conf.edge_snap)
+            edge_snap_move(c, &nx, &ny);
+        if (conf.edge_lock)
+            client_move_relative(c, nx - c->geom.x, ny - c->geom.y);
+        else
+            client_move_absolute(c, nx, ny);
+    } else {
+        nw = drag.geom.width + (drag.px - drag.x);
+        nh = drag.geom.height + (drag.py - drag.y);
+        if (conf.edge_snap)
+            edge_snap_resize(c, &nw, &nh);
+        if (conf.edge_lock)
+            client_resize_relative(c, nw - c->geom.width, nh - c->geom.height);
+        else
+            client_resize_absolute(c, nw, nh);
+    }
+}
+
+/* End the drag, putting the frame back where it started if restore is
+ * set. Also called when the dragged client goes away, see client_delete.
+ */
+static void
+drag_stop(bool restore)
+{
+    struct client *c = drag.client;
+
+    if (c == NULL)
+        return;
+
+    LOGN("Stopping drag");
     XUngrabPointer(display, CurrentTime);
+    XUngrabKeyboard(display, CurrentTime);
+    timer_del(&timers, &drag_timer);
+    drag.client = NULL;
+    drag.mode = DragNone;
+    drag.pending = false;
+    edges_invalidate();
+
+    if (restore)
+        client_move_resize(c, drag.geom.x, drag.geom.y, drag.geom.width, drag.geom.height);
+}
+
+static void
+handle_motion_notify(XEvent *e)
+{
+    XMotionEvent *ev = &e->xmotion;
+
+    if (drag.client == NULL)
+        return;
+
+    /* Only the last position of a batch is applied, see drag_update */
+    drag.px = ev->x_root;
+    drag.py = ev->y_root;
+    drag.time = ev->time;
+    drag.pending = true;
+}
+
+static void
+handle_button_release(XEvent *e)
+{
+    XButtonReleasedEvent *ev = &e->xbutton;
+    struct client *c = drag.client;
+
+    if (c == NULL || ev->button != drag.button)
+        return;
+
+    LOGN("Handling button release event");
+    if (ev->x_root != drag.px || ev->y_root != drag.py) {
+        drag.px = ev->x_root;
+        drag.py = ev->y_root;
+        drag.pending = true;
+    }
+    drag.time = ev->time;
+    drag.applied = 0; /* the final position is never held back */
+    if (drag.pending)
+        drag_update();
+    drag_stop(false);
+
+    /* Publish whatever the rate limit held back during the drag */
+    client_set_status(c);
+}
+
+static void
+handle_key_press(XEvent *e)
+{
+    XKeyEvent *ev = &e->xkey;
+    unsigned int state;
+    long d[5];
+
+    if (drag.client != NULL) {
+        if (XLookupKeysym(ev, 0) == XK_Escape) {
+            LOGN("Cancelling drag");
+            drag_stop(true);
+        }
+        return;
+    }
+
+    if (ev->keycode >= KEYCODE_MAX)
+        return;
+    state = mod_clean(ev->state) & ~numlock_mask;
+    for (struct binding *b = binding_table[ev->keycode]; b != NULL; b = b->next) {
+        if (b->mods != state)
+            continue;
+        /* The command may clear the bindings, b is not used past here */
+        LOGP("Running key binding %s", b->spec);
+        memcpy(d, b->data, sizeof d);
+        ipc_command(d, b->str, NULL);
+        return;
+    }
+}
+
+static void
+handle_mapping_notify(XEvent *e)
+{
+    XMappingEvent *ev = &e->xmapping;
+
+    XRefreshKeyboardMapping(ev);
+    if (ev->request == MappingKeyboard || ev->request == MappingModifier)
+        bindings_grab();
 }
 
 static void
@@ -768,19 +1141,19 @@ handle_property_notify(XEvent *e)
     struct client *c;
 
     LOGN("Handling property notify event");
-    c = get_client_from_window(ev->window);
-
-    if (c == NULL)
+    if (ev->state == PropertyDelete || ev->atom != net_atom[NetWMName])
         return;
 
-    if (ev->state == PropertyDelete)
+    /* The title is fetched once per batch in titles_refresh, or when a
+     * client on a hidden workspace is shown again
+     */
+    c = get_client_from_window(ev->window);
+    if (c == NULL)
         return;
 
-    if (ev->atom == net_atom[NetWMName]) {
-        LOGN("Updating client title");
-        client_set_title(c);
-        draw_text(c, c == f_client);
-    }
+    LOGN("Marking client title dirty");
+    c->title_dirty = true;
+    titles_dirty = true;
 }
 
 static void
@@ -788,17 +1161,35 @@ handle_configure_notify(XEvent *e)
 {
     XConfigureEvent *ev = &e->xconfigure;
 
-    if (ev->window == root) {
-        // handle display size changes by the root window
-        display_width = ev->width;
-        display_height = ev->height;
-    }
-
+    /* Client windows report their own geometry changes here as well, only
+     * the root window tells us anything about the monitor layout.
+     */
+    if (ev->window != root)
+        return;
 
     LOGN("Handling configure notify event");
 
-    monitors_free();
-    monitors_setup();
+    // handle display size changes by the root window
+    display_width = ev->width;
+    display_height = ev->height;
+
+    /* Without RandR a resize of the root window is the only hint we get */
+    if (randr_base < 0)
+        monitors_dirty = true;
+}
+
+/* RandR reports a burst of screen, output and crtc changes for a single
+ * reconfiguration, so only note that the layout has to be read again.
+ */
+static void
+handle_randr_notify(XEvent *e)
+{
+    LOGN("Handling RandR notify event");
+
+    XRRUpdateConfiguration(e);
+    display_width = DisplayWidth(display, screen);
+    display_height = DisplayHeight(display, screen);
+    monitors_dirty = true;
 }
 
 static void
@@ -845,12 +1236,13 @@ handle_map_request(XEvent *e)
 
     /*LOGN("Handling map request event");*/
 
+    stats.round_trips[StatGetWindowAttributes]++;
     if (!XGetWindowAttributes(display, ev->window, &wa))
         return;
     if (wa.override_redirect)
         return;
 
-    manage_new_window(ev->window, &wa);
+    manage_new_window(ev->window, &wa, false);
 }
 
 static void
@@ -861,12 +1253,14 @@ handle_unmap_notify(XEvent *e)
     c = get_client_from_window(ev->window);
 
     if (c != NULL) {
+        int ws = c->ws;
         LOGN("Client found while unmapping, focusing next client");
         focus_best(c);
         if (c->decorated)
             client_decorations_destroy(c);
         client_delete(c);
         free(c);
+        layout_changed(ws);
         client_raise(f_client);
     } else {
         /* Some applications *ahem* Spotify *ahem*, don't seem to place nicely with being deleted.
@@ -956,6 +1350,18 @@ ipc_monocle(long *d)
     client_monocle(f_client);
 }
 
+static void
+ipc_layout(long *d)
+{
+    if (d[1] < 0 || d[1] >= LayoutLast) {
+        LOGN("Unknown layout, ignoring");
+        return;
+    }
+
+    ws_layout[curr_ws] = d[1];
+    layout_apply(curr_ws);
+}
+
 static void
 ipc_raise(long *d)
 {
@@ -1113,7 +1519,7 @@ ipc_below(long *d)
     if (f_client == NULL)
         return;
 
-    ewmh_set_below(f_client, !client_window_is_below(f_client));
+    client_set_layer(f_client, f_client->layer == LayerBelow ? LayerNormal : LayerBelow);
 }
 
 static void
@@ -1127,6 +1533,7 @@ ipc_pointer_focus(long *d)
     struct client *c;
 
     XQueryPointer(display, root, &dummy, &child, &x, &y, &di, &di, &dui);
+    stats.round_trips[StatQueryPointer]++;
     c = get_client_from_window(child);
 
     if (c != NULL)
@@ -1152,43 +1559,56 @@ ipc_config(long *d)
     switch (cmd) {
         case IPCFocusColor:
             conf.bf_color = d[2];
+            config_dirty |= DirtyColor;
             break;
         case IPCUnfocusColor:
             conf.bu_color = d[2];
+            config_dirty |= DirtyColor;
             break;
         case IPCInnerFocusColor:
             conf.if_color = d[2];
+            config_dirty |= DirtyColor;
             break;
         case IPCInnerUnfocusColor:
             conf.iu_color = d[2];
+            config_dirty |= DirtyColor;
             break;
         case IPCTitleFocusColor:
             load_color(&xft_focus_color, d[2]);
+            config_dirty |= DirtyText;
             break;
         case IPCTitleUnfocusColor:
             load_color(&xft_unfocus_color, d[2]);
+            config_dirty |= DirtyText;
             break;
         case IPCBorderWidth:
             conf.b_width = d[2];
+            config_dirty |= DirtyLayout;
             break;
         case IPCInnerBorderWidth:
             conf.i_width = d[2];
+            config_dirty |= DirtyLayout;
             break;
         case IPCTitleHeight:
             conf.t_height = d[2];
+            config_dirty |= DirtyLayout;
             break;
         case IPCEdgeGap:
             conf.top_gap = d[2];
             conf.bot_gap = d[3];
+            config_dirty |= DirtyGaps;
             break;
         case IPCTopGap:
             conf.top_gap = d[2];
+            config_dirty |= DirtyGaps;
             break;
         case IPCEdgeLock:
             conf.edge_lock = d[2];
+            config_dirty |= DirtyGaps;
             break;
         case IPCJSONStatus:
             conf.json_status = d[2];
+            config_dirty |= DirtyStatus;
             break;
         case IPCManage:
             conf.manage[(int)d[2]] = true;
@@ -1207,6 +1627,7 @@ ipc_config(long *d)
             break;
         case IPCDrawText:
             conf.draw_text = d[2];
+            config_dirty |= DirtyText;
             break;
         case IPCFocusButton:
             ungrab_buttons();
@@ -1236,6 +1657,21 @@ ipc_config(long *d)
         case IPCPointerInterval:
             conf.pointer_interval = d[2];
             break;
+        case IPCStatusInterval:
+            conf.status_interval = d[2];
+            break;
+        case IPCTitleInterval:
+            conf.title_interval = d[2];
+            break;
+        case IPCSlowThreshold:
+            conf.slow_threshold = d[2];
+            break;
+        case IPCEdgeSnap:
+            conf.edge_snap = d[2];
+            break;
+        case IPCSnapDistance:
+            conf.snap_distance = d[2];
+            break;
         case IPCFocusFollowsPointer:
             conf.follow_pointer = d[2];
             break;
@@ -1247,13 +1683,45 @@ ipc_config(long *d)
         case IPCWarpPointer:
             conf.warp_pointer = d[2];
             break;
+        case IPCAutoLayout:
+            conf.auto_layout = d[2];
+            break;
         case IPCSmartPlace:
             conf.smart_place = d[2];
         default:
             break;
     }
 
-    refresh_config();
+}
+
+static void
+ipc_dump_record(long *d)
+{
+    UNUSED(d);
+    record_dump();
+}
+
+static void
+ipc_clear_rules(long *d)
+{
+    UNUSED(d);
+    rules_clear();
+}
+
+static void
+ipc_clear_bindings(long *d)
+{
+    UNUSED(d);
+    bindings_clear();
+}
+
+static void
+ipc_restart(long *d)
+{
+    UNUSED(d);
+    LOGN("Restarting...");
+    restarting = true;
+    running = false;
 }
 
 static void
@@ -1272,7 +1740,249 @@ ipc_edge_gap(long *d)
 
     LOGN("Changing edge gap...");
 
-    refresh_config();
+    config_dirty |= DirtyGaps;
+}
+
+/* Serialize the runtime counters as JSON into BERRY_STATS on the root window.
+ * Counters are keyed by X event type and IPC command number, zeroes are omitted.
+ */
+static void
+ipc_dump_stats(long *d)
+{
+    UNUSED(d);
+    struct strbuf sb = { 0 };
+    int total = 0;
+    const char *sep;
+
+    LOGN("Dumping runtime statistics");
+
+    strbuf_printf(&sb, "{\"events\":{");
+    sep = "";
+    for (int i = 0; i < LASTEvent; i++) {
+        if (stats.events[i] == 0)
+            continue;
+        strbuf_printf(&sb, "%s\"%d\":{\"count\":%lu,\"requests\":%lu}",
+                sep, i, stats.events[i], stats.requests[i]);
+        sep = ",";
+    }
+
+    strbuf_printf(&sb, "},\"ipc\":{");
+    sep = "";
+    for (int i = 0; i < IPCLast; i++) {
+        if (stats.ipc[i] == 0)
+            continue;
+        strbuf_printf(&sb, "%s\"%d\":{\"count\":%lu,\"requests\":%lu}",
+                sep, i, stats.ipc[i], stats.ipc_requests[i]);
+        sep = ",";
+    }
+
+    strbuf_printf(&sb, "},\"round_trips\":{");
+    for (int i = 0; i < StatLast; i++)
+        strbuf_printf(&sb, "%s\"%s\":%lu", i ? "," : "", stat_round_trip_names[i], stats.round_trips[i]);
+
+    strbuf_printf(&sb, "},\"queue_max\":%d,\"workspaces\":[", stats.queue_max);
+    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
+        int count = 0;
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+            count++;
+        total += count;
+        strbuf_printf(&sb, "%s%d", i ? "," : "", count);
+    }
+    strbuf_printf(&sb, "],\"clients\":%d,\"monitors\":%d}", total, m_count);
+
+    if (sb.data == NULL) {
+        LOGN("Could not allocate statistics buffer");
+        return;
+    }
+
+    XChangeProperty(display, root, net_berry[BerryStats], utf8string, 8, PropModeReplace,
+            (unsigned char *) sb.data, sb.len);
+    strbuf_free(&sb);
+}
+
+/* Answer a query with a JSON snapshot of the window manager state. Over the
+ * socket the snapshot is returned in reply. Over X it is written into
+ * BERRY_QUERY_REPLY on the window berryc passed in d[2], once run() has
+ * done the deferred work of the batch, so the answer also tells that the
+ * commands sent before it have been carried out completely.
+ */
+static int
+ipc_query(long *d, struct strbuf *reply)
+{
+    if (d[1] < 0 || d[1] >= QueryLast || (reply == NULL && d[2] == 0))
+        return IPCBadArgument;
+
+    if (reply != NULL) {
+        if (config_dirty)
+            refresh_config();
+        query_serialize(d[1], reply);
+        return reply->data != NULL ? IPCSuccess : IPCFailure;
+    }
+
+    if (query_count == QUERY_PENDING)
+        queries_answer();
+    query_queue[query_count].kind = d[1];
+    query_queue[query_count].window = (Window)d[2];
+    query_count++;
+    return IPCSuccess;
+}
+
+static void
+query_write(long kind, Window w)
+{
+    struct strbuf sb = { 0 };
+
+    query_serialize(kind, &sb);
+    if (sb.data == NULL)
+        return;
+    XChangeProperty(display, w, net_berry[BerryQueryReply], utf8string, 8, PropModeReplace,
+            (unsigned char *) sb.data, sb.len);
+    strbuf_free(&sb);
+}
+
+/* Answer the queries received over X, in the order they came in */
+static void
+queries_answer(void)
+{
+    if (config_dirty)
+        refresh_config();
+    for (int i = 0; i < query_count; i++)
+        query_write(query_queue[i].kind, query_queue[i].window);
+    query_count = 0;
+}
+
+static void
+query_client(struct client *c, struct strbuf *sb)
+{
+    strbuf_printf(sb,
+            "{"
+                "\"window\":\"0x%08x\","
+                "\"workspace\":%d,"
+                "\"monitor\":%d,"
+                "\"geom\":{\"x\":%d,\"y\":%d,\"width\":%d,\"height\":%d},"
+                "\"state\":\"%s\","
+                "\"decorated\":%s,"
+                "\"focused\":%s,"
+                "\"title\":",
+            (unsigned int)c->window, c->ws, ws_m_list[c->ws],
+            c->geom.x, c->geom.y, c->geom.width, c->geom.height,
+            client_state(c), c->decorated ? "true" : "false",
+            c == f_client ? "true" : "false");
+    strbuf_json_string(sb, c->title);
+    strbuf_append(sb, "}", 1);
+}
+
+/* Serialize one kind of state as JSON. Windows are listed per workspace in
+ * stacking order, workspaces and monitors by number.
+ */
+static void
+query_serialize(int kind, struct strbuf *sb)
+{
+    const char *sep = "";
+
+    switch (kind) {
+        case QueryWindows:
+            strbuf_append(sb, "[", 1);
+            for (int i = 0; i < WORKSPACE_NUMBER; i++) {
+                for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
+                    strbuf_printf(sb, "%s", sep);
+                    query_client(tmp, sb);
+                    sep = ",";
+                }
+            }
+            strbuf_append(sb, "]", 1);
+            break;
+        case QueryWorkspaces:
+            strbuf_append(sb, "[", 1);
+            for (int i = 0; i < WORKSPACE_NUMBER; i++) {
+                int count = 0;
+                for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+                    count++;
+                strbuf_printf(sb, "%s{\"id\":%d,\"monitor\":%d,\"clients\":%d,\"focused\":%s,\"visible\":%s}",
+                        i ? "," : "", i, ws_m_list[i], count,
+                        i == curr_ws ? "true" : "false",
+                        i == curr_ws || (c_list[i] != NULL && !c_list[i]->hidden) ? "true" : "false");
+            }
+            strbuf_append(sb, "]", 1);
+            break;
+        case QueryMonitors:
+            strbuf_append(sb, "[", 1);
+            for (int i = 0; i < m_count; i++) {
+                strbuf_printf(sb, "%s{\"id\":%d,\"x\":%d,\"y\":%d,\"width\":%d,\"height\":%d,\"workspaces\":[",
+                        i ? "," : "", i, m_list[i].x, m_list[i].y, m_list[i].width, m_list[i].height);
+                sep = "";
+                for (int j = 0; j < WORKSPACE_NUMBER; j++) {
+                    if (ws_m_list[j] != i)
+                        continue;
+                    strbuf_printf(sb, "%s%d", sep, j);
+                    sep = ",";
+                }
+                strbuf_append(sb, "]}", 2);
+            }
+            strbuf_append(sb, "]", 1);
+            break;
+        case QueryFocused:
+            if (f_client != NULL)
+                query_client(f_client, sb);
+            else
+                strbuf_printf(sb, "null");
+            break;
+    }
+}
+
+/* Run a command received from berryc over either transport. str holds the
+ * string argument of commands which carry one, which is only sent over the
+ * socket; over X it is passed through root window properties instead.
+ * Commands which answer with data append it to reply when it is non-NULL.
+ */
+static int
+ipc_command(long *d, const char *str, struct strbuf *reply)
+{
+    long cmd = d[0], type;
+    unsigned long req, rt, start;
+    int status = IPCSuccess;
+
+    if (cmd < 0 || cmd >= IPCLast) {
+        LOGP("Unknown IPC command %ld, ignoring", cmd);
+        return IPCUnknownCommand;
+    }
+
+    /* Settings are recorded under their own name */
+    type = cmd == IPCConfig && d[1] >= 0 && d[1] < IPCLast ? d[1] | RECORD_CONFIG : cmd;
+    start = record_now();
+    req = NextRequest(display);
+    rt = stats_round_trips();
+    if (cmd == IPCSetFont && str != NULL) {
+        status = font_set(str) ? IPCSuccess : IPCBadArgument;
+        if (status == IPCSuccess)
+            ipc_event_config(d);
+    } else if (cmd == IPCQuery) {
+        status = ipc_query(d, reply);
+    } else if (cmd == IPCLayout && (d[1] < 0 || d[1] >= LayoutLast)) {
+        status = IPCBadArgument;
+    } else if (cmd == IPCRule) {
+        status = str != NULL && rule_add(str) ? IPCSuccess : IPCBadArgument;
+    } else if (cmd == IPCBind) {
+        status = str != NULL && binding_add(str) ? IPCSuccess : IPCBadArgument;
+    } else if (cmd == IPCNameDesktop && str != NULL) {
+        if (d[1] < 0 || d[1] >= WORKSPACE_NUMBER)
+            status = IPCBadArgument;
+        else
+            desktop_name_set(d[1], str);
+    } else if (ipc_handler[cmd] != NULL) {
+        ipc_handler[cmd](d);
+        if (cmd == IPCConfig || cmd == IPCEdgeGap)
+            ipc_event_config(d);
+    } else {
+        LOGP("No handler for IPC command %ld, ignoring", cmd);
+        return IPCUnknownCommand;
+    }
+    stats.ipc[cmd]++;
+    stats.ipc_requests[cmd] += NextRequest(display) - req;
+    record_add(type | RECORD_IPC, f_client ? f_client->window : None, start,
+            NextRequest(display) - req, stats_round_trips() - rt);
+
+    return status;
 }
 
 static void
@@ -1291,6 +2001,7 @@ ipc_save_monitor(long *d)
 
     /* Associate the given workspace to the given monitor */
     ws_m_list[ws] = mon;
+    edges_invalidate();
     ewmh_set_viewport();
 }
 
@@ -1306,54 +2017,580 @@ ipc_set_font(long *d)
     font_list = NULL;
     LOGN("Getting text property");
     XGetTextProperty(display, root, &font_prop, net_berry[BerryFontProperty]);
+    stats.round_trips[StatGetWindowProperty]++;
     LOGN("Converting to text list");
     err = XmbTextPropertyToTextList(display, &font_prop, &font_list, &n);
-    strncpy(global_font, font_list[0], sizeof(global_font));
-    LOGN("Opening font by name");
-    font = XftFontOpenName(display, screen, global_font);
-    if (font == NULL) {
-        LOGN("Error, could not open font name");
-        return;
-    }
-    refresh_config();
-    if (err >= Success && n > 0 && *font_list)
+    if (err >= Success && n > 0 && *font_list) {
+        font_set(font_list[0]);
         XFreeStringList(font_list);
+    }
     XFree(font_prop.value);
 }
 
-static void
-load_color(XftColor *dest_color, unsigned long raw_color)
+static bool
+font_set(const char *name)
 {
-    XColor x_color;
-    x_color.pixel = raw_color;
-    XQueryColor(display, DefaultColormap(display, screen), &x_color);
-    r_color.blue = x_color.blue;
-    r_color.green = x_color.green;
-    r_color.red = x_color.red;
-    r_color.alpha = DEFAULT_ALPHA;
+    XftFont *tmp;
 
-    XftColorFree(display, DefaultVisual(display, screen), DefaultColormap(display, screen), dest_color);
-    XftColorAllocValue(display, DefaultVisual(display, screen), DefaultColormap(display, screen),
-            &r_color, dest_color);
+    tmp = font_acquire(name);
+    if (tmp == NULL) {
+        LOGN("Error, could not open font name");
+        return false;
+    }
+    strncpy(global_font, name, sizeof(global_font) - 1);
+    if (tmp == font) {
+        font_release(tmp);
+        return true;
+    }
+    font_release(font);
+    font = tmp;
+    config_dirty |= DirtyText;
+    return true;
 }
 
-
-static void
-load_config(char *conf_path)
+/* Return a reference to the font with the given pattern, opening it only
+ * if it is not cached. A miss takes a free slot or evicts the least
+ * recently used font nobody holds.
+ */
+static XftFont *
+font_acquire(const char *name)
 {
-    if (fork() == 0) {
-        setsid();
-        execl("/bin/sh", "sh", conf_path, NULL);
-        LOGP("CONFIG PATH: %s", conf_path);
+    struct font_cache *slot = NULL;
+    XftFont *f;
+
+    for (int i = 0; i < FONT_CACHE_SIZE; i++) {
+        if (font_cache[i].font != NULL && strcmp(font_cache[i].name, name) == 0) {
+            LOGP("Font %s is cached", name);
+            font_cache[i].refs++;
+            font_cache[i].used = ++font_clock;
+            return font_cache[i].font;
+        }
     }
-}
 
-static void
-client_manage_focus(struct client *c)
-{
-    if (c != NULL && f_client != NULL) {
-        client_set_color(f_client, conf.iu_color, conf.bu_color);
-        draw_text(f_client, false);
+    LOGN("Opening font by name");
+    f = XftFontOpenName(display, screen, name);
+    if (f == NULL)
+        return NULL;
+
+    for (int i = 0; i < FONT_CACHE_SIZE; i++) {
+        struct font_cache *e = &font_cache[i];
+        if (e->font == NULL) {
+            slot = e;
+            break;
+        }
+        if (e->refs == 0 && (slot == NULL || e->used < slot->used))
+            slot = e;
+    }
+
+    /* Every cached font is in use, hand out an uncached one */
+    if (slot == NULL)
+        return f;
+
+    if (slot->font != NULL) {
+        LOGP("Evicting font %s", slot->name);
+        XftFontClose(display, slot->font);
+    }
+    snprintf(slot->name, sizeof slot->name, "%s", name);
+    slot->font = f;
+    slot->refs = 1;
+    slot->used = ++font_clock;
+    return f;
+}
+
+/* Drop a reference taken by font_acquire. Cached fonts stay open for the
+ * next acquire, the others are closed right away.
+ */
+static void
+font_release(XftFont *f)
+{
+    if (f == NULL)
+        return;
+
+    for (int i = 0; i < FONT_CACHE_SIZE; i++) {
+        if (font_cache[i].font == f) {
+            if (font_cache[i].refs > 0)
+                font_cache[i].refs--;
+            return;
+        }
+    }
+    XftFontClose(display, f);
+}
+
+static void
+font_cache_free(void)
+{
+    font_release(font);
+    font = NULL;
+    for (int i = 0; i < FONT_CACHE_SIZE; i++) {
+        if (font_cache[i].font != NULL)
+            XftFontClose(display, font_cache[i].font);
+        font_cache[i].font = NULL;
+        font_cache[i].refs = 0;
+    }
+}
+
+/* Rename a single entry of _NET_DESKTOP_NAMES, keeping all others */
+static void
+desktop_name_set(int ws, const char *name)
+{
+    XTextProperty text_prop;
+    char **list = NULL, *names[WORKSPACE_NUMBER];
+    int n = 0;
+
+    stats.round_trips[StatGetWindowProperty]++;
+    if (XGetTextProperty(display, root, &text_prop, net_atom[NetDesktopNames])) {
+        Xutf8TextPropertyToTextList(display, &text_prop, &list, &n);
+        XFree(text_prop.value);
+    }
+
+    for (int i = 0; i < WORKSPACE_NUMBER; i++)
+        names[i] = i < n ? list[i] : "";
+    names[ws] = (char *)name;
+
+    Xutf8TextListToTextProperty(display, names, WORKSPACE_NUMBER, XUTF8StringStyle, &text_prop);
+    XSetTextProperty(display, root, &text_prop, net_atom[NetDesktopNames]);
+    XFree(text_prop.value);
+    if (list)
+        XFreeStringList(list);
+}
+
+static void
+load_color(XftColor *dest_color, unsigned long raw_color)
+{
+    XColor x_color;
+    x_color.pixel = raw_color;
+    XQueryColor(display, DefaultColormap(display, screen), &x_color);
+    stats.round_trips[StatQueryColor]++;
+    r_color.blue = x_color.blue;
+    r_color.green = x_color.green;
+    r_color.red = x_color.red;
+    r_color.alpha = DEFAULT_ALPHA;
+
+    XftColorFree(display, DefaultVisual(display, screen), DefaultColormap(display, screen), dest_color);
+    XftColorAllocValue(display, DefaultVisual(display, screen), DefaultColormap(display, screen),
+            &r_color, dest_color);
+}
+
+
+/* Read berryrc, a file of "option value..." lines using the same names as
+ * berryc. Like any other setting change the clients are only touched by
+ * refresh_config, once, before berry waits for the next event.
+ */
+static void
+load_settings(const char *path)
+{
+    FILE *f;
+    char line[IPC_STRING_MAX + MAXLEN];
+    int lineno = 0;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        LOGP("No settings found at %s", path);
+        return;
+    }
+
+    LOGP("Loading settings from %s", path);
+    while (fgets(line, sizeof line, f) != NULL)
+        settings_line(path, ++lineno, line);
+    fclose(f);
+}
+
+/* Apply one line of settings, using the same syntax as berryc commands */
+static void
+settings_line(const char *path, int lineno, char *line)
+{
+    char *words[BATCH_MAX_WORDS];
+    const struct command *c;
+    const char *str;
+    long d[5];
+    int n;
+
+    n = split_line(line, words, BATCH_MAX_WORDS);
+    if (n == 0)
+        return;
+    if (n < 0) {
+        fprintf(stderr, "%s:%d: too many arguments\n", path, lineno);
+        return;
+    }
+
+    c = command_lookup(words[0]);
+    if (c == NULL) {
+        fprintf(stderr, "%s:%d: unknown option %s\n", path, lineno, words[0]);
+        return;
+    }
+    if (c->argc >= 0 && c->argc != n - 1) {
+        fprintf(stderr, "%s:%d: %s expects %d arguments\n", path, lineno, c->name, c->argc);
+        return;
+    }
+
+    str = command_pack(c, d, n - 1, words + 1);
+    if (ipc_command(d, str, NULL) != IPCSuccess)
+        fprintf(stderr, "%s:%d: could not apply %s\n", path, lineno, c->name);
+}
+
+/* Write the current settings as settings lines prefixed with "set", so a
+ * restarted berry applies them through the same path as berryrc.
+ */
+static void
+settings_write(FILE *f)
+{
+    static const struct { unsigned int mask; const char *name; } masks[] = {
+        { ShiftMask, "shift" }, { LockMask, "lock" }, { ControlMask, "ctrl" },
+        { Mod1Mask, "mod1" }, { Mod2Mask, "mod2" }, { Mod3Mask, "mod3" },
+        { Mod4Mask, "mod4" }, { Mod5Mask, "mod5" },
+    };
+    const struct { const char *name; int mask; } mask_settings[] = {
+        { "move_mask", conf.move_mask }, { "resize_mask", conf.resize_mask },
+    };
+    XTextProperty text_prop;
+    char **names = NULL;
+    int n = 0;
+
+    fprintf(f, "set focus_color %06lx\n", conf.bf_color);
+    fprintf(f, "set unfocus_color %06lx\n", conf.bu_color);
+    fprintf(f, "set inner_focus_color %06lx\n", conf.if_color);
+    fprintf(f, "set inner_unfocus_color %06lx\n", conf.iu_color);
+    fprintf(f, "set text_focus_color %06lx\n", xft_focus_color.pixel);
+    fprintf(f, "set text_unfocus_color %06lx\n", xft_unfocus_color.pixel);
+    fprintf(f, "set border_width %d\n", conf.b_width);
+    fprintf(f, "set inner_border_width %d\n", conf.i_width);
+    fprintf(f, "set title_height %d\n", conf.t_height);
+    fprintf(f, "set edge_gap %d %d %d %d\n", conf.top_gap, conf.bot_gap, conf.left_gap, conf.right_gap);
+    fprintf(f, "set edge_lock %s\n", conf.edge_lock ? "true" : "false");
+    fprintf(f, "set edge_snap %s\n", conf.edge_snap ? "true" : "false");
+    fprintf(f, "set snap_distance %d\n", conf.snap_distance);
+    fprintf(f, "set smart_place %s\n", conf.smart_place ? "true" : "false");
+    fprintf(f, "set draw_text %s\n", conf.draw_text ? "true" : "false");
+    fprintf(f, "set json_status %s\n", conf.json_status ? "true" : "false");
+    fprintf(f, "set decorate_new %s\n", conf.decorate ? "true" : "false");
+    fprintf(f, "set fullscreen_remove_dec %s\n", conf.fs_remove_dec ? "true" : "false");
+    fprintf(f, "set fullscreen_max %s\n", conf.fs_max ? "true" : "false");
+    fprintf(f, "set focus_button %d\n", conf.focus_button);
+    fprintf(f, "set move_button %d\n", conf.move_button);
+    fprintf(f, "set resize_button %d\n", conf.resize_button);
+    fprintf(f, "set pointer_interval %d\n", conf.pointer_interval);
+    fprintf(f, "set status_interval %d\n", conf.status_interval);
+    fprintf(f, "set title_interval %d\n", conf.title_interval);
+    fprintf(f, "set slow_threshold %d\n", conf.slow_threshold);
+    fprintf(f, "set focus_follows_pointer %s\n", conf.follow_pointer ? "true" : "false");
+    fprintf(f, "set focus_on_click %s\n", conf.focus_on_click ? "true" : "false");
+    fprintf(f, "set warp_pointer %s\n", conf.warp_pointer ? "true" : "false");
+    fprintf(f, "set auto_layout %s\n", conf.auto_layout ? "true" : "false");
+    fprintf(f, "set set_font ");
+    settings_quote(f, global_font);
+    fputc('\n', f);
+
+    for (size_t i = 0; i < sizeof mask_settings / sizeof mask_settings[0]; i++) {
+        const char *sep = "";
+        fprintf(f, "set %s ", mask_settings[i].name);
+        for (size_t j = 0; j < sizeof masks / sizeof masks[0]; j++) {
+            if (mask_settings[i].mask & masks[j].mask) {
+                fprintf(f, "%s%s", sep, masks[j].name);
+                sep = "|";
+            }
+        }
+        fputc('\n', f);
+    }
+
+    for (int i = 0; i < WindowLast; i++)
+        fprintf(f, "set %s %s\n", conf.manage[i] ? "manage" : "unmanage", window_type_names[i]);
+
+    for (struct rule *r = rule_list; r != NULL; r = r->after) {
+        fprintf(f, "set rule ");
+        settings_quote(f, r->spec);
+        fputc('\n', f);
+    }
+    for (struct binding *b = binding_list; b != NULL; b = b->after) {
+        fprintf(f, "set bind ");
+        settings_quote(f, b->spec);
+        fputc('\n', f);
+    }
+
+    stats.round_trips[StatGetWindowProperty]++;
+    if (XGetTextProperty(display, root, &text_prop, net_atom[NetDesktopNames])) {
+        Xutf8TextPropertyToTextList(display, &text_prop, &names, &n);
+        XFree(text_prop.value);
+    }
+    for (int i = 0; i < n && i < WORKSPACE_NUMBER; i++) {
+        fprintf(f, "set name_desktop %d ", i);
+        settings_quote(f, names[i]);
+        fputc('\n', f);
+    }
+    if (names)
+        XFreeStringList(names);
+}
+
+/* Write str as a single word split_line reads back unchanged: in single
+ * quotes, with every single quote put in double quotes of its own
+ */
+static void
+settings_quote(FILE *f, const char *str)
+{
+    fputc('\'', f);
+    for (; *str; str++) {
+        if (*str == '\'')
+            fputs("'\"'\"'", f);
+        else
+            fputc(*str, f);
+    }
+    fputc('\'', f);
+}
+
+/* Serialize everything a restarted berry needs to take over the session
+ * without touching a window: settings, workspaces and monitor assignments,
+ * and every client with its stacking and focus order.
+ */
+static void
+state_write(FILE *f)
+{
+    fprintf(f, "%s %d\n", STATE_MAGIC, STATE_VERSION);
+    settings_write(f);
+    fprintf(f, "workspace %d\n", curr_ws);
+    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
+        fprintf(f, "monitor %d %d\n", i, ws_m_list[i]);
+        fprintf(f, "layout %d %d %d\n", i, ws_layout[i], layout_pending[i]);
+    }
+
+    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
+        int n = 0, j;
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+            n++;
+        struct client *order[n + 1];
+
+        /* Written back to front, restoring prepends each client again */
+        j = 0;
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+            order[j++] = tmp;
+        while (j-- > 0) {
+            struct client *c = order[j];
+            fprintf(f, "client %d 0x%lx %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d ",
+                    c->ws, c->window, c->geom.x, c->geom.y, c->geom.width, c->geom.height,
+                    c->prev.x, c->prev.y, c->prev.width, c->prev.height, c->x_hide,
+                    c->decorated, c->hidden, c->fullscreen, c->mono, c->was_fs, c->layer);
+            for (const char *p = c->title; *p; p++)
+                fputc(*p == '\n' ? ' ' : *p, f);
+            fputc('\n', f);
+        }
+
+        j = 0;
+        for (struct client *tmp = f_list[i]; tmp != NULL && j < n; tmp = tmp->f_next)
+            order[j++] = tmp;
+        while (j-- > 0)
+            fprintf(f, "focus %d 0x%lx\n", i, order[j]->window);
+    }
+
+    if (f_client != NULL)
+        fprintf(f, "focused 0x%lx\n", f_client->window);
+}
+
+/* Take over from the instance that restarted into this one. Returns false
+ * if the state cannot be read, berry then starts as if freshly launched.
+ */
+static bool
+state_restore(int fd)
+{
+    FILE *f;
+    char line[IPC_STRING_MAX + MAXLEN];
+    bool focus_seen[WORKSPACE_NUMBER] = { false };
+    struct client *c, *focused = NULL;
+    unsigned long w;
+    int version, ws, mon, kind, pending, lineno = 1;
+
+    f = fdopen(fd, "r");
+    if (f == NULL)
+        return false;
+
+    if (fgets(line, sizeof line, f) == NULL ||
+            sscanf(line, STATE_MAGIC " %d", &version) != 1 || version != STATE_VERSION) {
+        LOGN("Unknown restart state, starting afresh");
+        fclose(f);
+        return false;
+    }
+
+    LOGN("Restoring state from previous instance");
+    while (fgets(line, sizeof line, f) != NULL) {
+        lineno++;
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "set ", 4) == 0) {
+            settings_line("restart state", lineno, line + 4);
+        } else if (strncmp(line, "client ", 7) == 0) {
+            state_restore_client(line);
+        } else if (sscanf(line, "focused %lx", &w) == 1) {
+            focused = get_client_from_window(w);
+        } else if (sscanf(line, "focus %d %lx", &ws, &w) == 2) {
+            c = get_client_from_window(w);
+            if (c == NULL || c->ws != ws)
+                continue;
+            if (!focus_seen[ws])
+                f_list[ws] = NULL;
+            focus_seen[ws] = true;
+            c->f_next = f_list[ws];
+            f_list[ws] = c;
+        } else if (sscanf(line, "workspace %d", &ws) == 1) {
+            if (ws >= 0 && ws < WORKSPACE_NUMBER)
+                curr_ws = ws;
+        } else if (sscanf(line, "monitor %d %d", &ws, &mon) == 2) {
+            if (ws >= 0 && ws < WORKSPACE_NUMBER)
+                ws_m_list[ws] = mon >= 0 && mon < m_count ? mon : 0;
+        } else if (sscanf(line, "layout %d %d %d", &ws, &kind, &pending) == 3) {
+            if (ws >= 0 && ws < WORKSPACE_NUMBER && kind >= 0 && kind < LayoutLast) {
+                ws_layout[ws] = kind;
+                layout_pending[ws] = pending;
+            }
+        }
+    }
+    fclose(f);
+
+    /* Decorations were created with the restored settings already */
+    config_dirty = 0;
+    ewmh_set_client_list();
+    ewmh_set_viewport();
+    if (focused != NULL)
+        client_move_to_front(focused);
+
+    return true;
+}
+
+/* Manage a client from its line in the restart state, exactly where the
+ * previous instance left it, without querying or placing the window.
+ */
+static void
+state_restore_client(char *line)
+{
+    struct client *c;
+    unsigned long w;
+    int ws, decorated, hidden, fullscreen, mono, was_fs, layer, off = -1;
+
+    c = malloc(sizeof(struct client));
+    if (c == NULL) {
+        LOGN("Error, malloc could not allocated restored window");
+        return;
+    }
+
+    if (sscanf(line, "client %d %lx %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %n",
+                &ws, &w, &c->geom.x, &c->geom.y, &c->geom.width, &c->geom.height,
+                &c->prev.x, &c->prev.y, &c->prev.width, &c->prev.height, &c->x_hide,
+                &decorated, &hidden, &fullscreen, &mono, &was_fs, &layer, &off) != 17 ||
+            off < 0 || ws < 0 || ws >= WORKSPACE_NUMBER || layer < LayerBelow || layer > LayerAbove ||
+            get_client_from_window(w) != NULL) {
+        free(c);
+        return;
+    }
+
+    c->window = w;
+    c->ws = ws;
+    c->layer = layer;
+    c->title_dirty = false;
+    c->title_time = 0;
+    c->decorated = false;
+    c->hidden = hidden;
+    c->fullscreen = fullscreen;
+    c->mono = false;
+    c->was_fs = was_fs;
+    c->status[0] = '\0';
+    c->status_time = 0;
+    c->seq = client_seq++;
+    snprintf(c->title, sizeof c->title, "%s", line + off);
+
+    if (decorated) {
+        client_decorations_create(c);
+        client_set_color(c, conf.iu_color, conf.bu_color);
+    }
+    client_save(c, ws);
+    client_relayout(c);
+    c->mono = mono;
+
+    if (c->decorated)
+        XMapWindow(display, c->dec);
+    XSelectInput(display, c->window, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
+    window_grab_buttons(c->window);
+    client_set_status(c);
+}
+
+/* Hand the session over to a fresh copy of berry: serialize the state into
+ * an unlinked temporary file and exec the binary in place, passing the file
+ * descriptor with -R. Only returns if that fails, berry then carries on.
+ */
+static void
+restart(void)
+{
+    FILE *f;
+    char fd_arg[16], **args;
+    int argc, n = 0;
+
+    f = tmpfile();
+    if (f == NULL) {
+        LOGN("Could not create restart state, not restarting");
+        return;
+    }
+
+    state_write(f);
+    for (argc = 0; berry_argv[argc] != NULL; argc++)
+        ;
+    args = malloc((argc + 3) * sizeof *args);
+    if (fflush(f) != 0 || lseek(fileno(f), 0, SEEK_SET) < 0 || args == NULL) {
+        LOGN("Could not write restart state, not restarting");
+        free(args);
+        fclose(f);
+        return;
+    }
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(berry_argv[i], "-R") == 0 && i + 1 < argc) {
+            i++;
+            continue;
+        }
+        args[n++] = berry_argv[i];
+    }
+    snprintf(fd_arg, sizeof fd_arg, "%d", fileno(f));
+    args[n++] = "-R";
+    args[n++] = fd_arg;
+    args[n] = NULL;
+
+    /* Give up the root window before the new instance asks for it */
+    publish_stop();
+    ipc_socket_close();
+    XSelectInput(display, root, NoEventMask);
+    /* Keep the frames on screen while the new instance starts, it kills
+     * them once its own are up
+     */
+    XSetCloseDownMode(display, RetainTemporary);
+    XSync(display, False);
+    fcntl(ConnectionNumber(display), F_SETFD, FD_CLOEXEC);
+
+    LOGP("Restarting as %s", args[0]);
+    while (log_flush(STDERR_FILENO) > 0)
+        ;
+    sigprocmask(SIG_UNBLOCK, &reactor_signals, NULL);
+    execvp(args[0], args);
+
+    sigprocmask(SIG_BLOCK, &reactor_signals, NULL);
+    LOGP("Could not exec %s, continuing", args[0]);
+    XSetCloseDownMode(display, DestroyAll);
+    free(args);
+    fclose(f);
+    XSelectInput(display, root, ROOT_MASK);
+    ipc_socket_setup();
+    publish_start();
+}
+
+static void
+load_config(char *conf_path)
+{
+    if (fork() == 0) {
+        sigprocmask(SIG_UNBLOCK, &reactor_signals, NULL);
+        setsid();
+        execl("/bin/sh", "sh", conf_path, NULL);
+        LOGP("CONFIG PATH: %s", conf_path);
+    }
+}
+
+static void
+client_manage_focus(struct client *c)
+{
+    if (c != NULL && f_client != NULL) {
+        client_set_color(f_client, conf.iu_color, conf.bu_color);
+        draw_text(f_client, false);
         manage_xsend_icccm(c, wm_atom[WMTakeFocus]);
     }
 
@@ -1374,22 +2611,31 @@ client_manage_focus(struct client *c)
         LOGN("Giving focus to dummy window");
         f_client = NULL;
         XSetInputFocus(display, nofocus, RevertToPointerRoot, CurrentTime);
+        ipc_event_client(EventFocus, NULL);
     }
 }
 
+/* Start managing the given window. Adopted windows, which were already
+ * mapped when berry started, keep their geometry and workspace and are
+ * neither placed nor focused.
+ */
 static void
-manage_new_window(Window w, XWindowAttributes *wa)
+manage_new_window(Window w, XWindowAttributes *wa, bool adopt)
 {
     /* Credits to vain for XGWP checking */
     Atom prop, da;
     unsigned char *prop_ret = NULL;
-    int di;
+    int di, type = WindowLast;
     unsigned long dl;
+    struct rule_action ra = rule_action_none;
+    stats.round_trips[StatGetWindowProperty]++;
     if (XGetWindowProperty(display, w, net_atom[NetWMWindowType], 0,
                 sizeof (Atom), False, XA_ATOM, &da, &di, &dl, &dl,
                 &prop_ret) == Success) {
         if (prop_ret) {
             prop = ((Atom *)prop_ret)[0];
+            type = window_type_index(prop);
+            XFree(prop_ret);
             if ((prop == net_atom[NetWMWindowTypeDock]    && !conf.manage[Dock])    ||
                 (prop == net_atom[NetWMWindowTypeToolbar] && !conf.manage[Toolbar]) ||
                 (prop == net_atom[NetWMWindowTypeUtility] && !conf.manage[Utility]) ||
@@ -1413,19 +2659,6 @@ manage_new_window(Window w, XWindowAttributes *wa)
         }
     }
 
-    // Get class information for the current window
-    XClassHint ch;
-    if (XGetClassHint(display, w, &ch) > Success) {
-        LOGP("client has class %s", ch.res_class);
-        LOGP("client has name %s", ch.res_name);
-        if (ch.res_class)
-            XFree(ch.res_class);
-        if (ch.res_name)
-            XFree(ch.res_name);
-    } else {
-        LOGN("could not retrieve client class name");
-    }
-
     struct client *c;
     c = malloc(sizeof(struct client));
     if (c == NULL) {
@@ -1434,72 +2667,681 @@ manage_new_window(Window w, XWindowAttributes *wa)
     }
     c->window = w;
     c->ws = curr_ws;
+    c->layer = window_get_layer(w);
+    c->title_dirty = false;
+    c->title_time = 0;
+    c->status[0] = '\0';
+    c->status_time = 0;
     c->geom.x = wa->x;
     c->geom.y = wa->y;
+    if (adopt) {
+        int ws = window_get_desktop(w);
+        if (ws >= 0 && ws < WORKSPACE_NUMBER)
+            c->ws = ws;
+        /* Keep the window where it is, the frame goes around it */
+        if (conf.decorate) {
+            c->geom.x -= conf.b_width + conf.i_width;
+            c->geom.y -= conf.b_width + conf.i_width + conf.t_height;
+        }
+    }
     c->geom.width = wa->width + 2 * (conf.b_width + conf.i_width);
     c->geom.height = wa->height + 2 * (conf.b_width + conf.i_width) + conf.t_height;
     c->hidden = false;
     c->fullscreen = false;
     c->mono = false;
     c->was_fs = false;
+    c->decorated = false;
+    c->seq = client_seq++;
+
+    /* Rules settle the window's final state before anything is mapped */
+    client_set_title(c);
+    if (!adopt)
+        ra = rules_apply(c, type);
+    if (ra.ws >= 0)
+        c->ws = ra.ws;
+    else if (ra.mon >= 0 && ra.mon < m_count)
+        c->ws = monitor_workspace(ra.mon);
+    if (ra.geom_mask)
+        rule_geometry(c, &ra);
 
     XSetWindowBorderWidth(display, c->window, 0);
 
-    if (conf.decorate)
+    if (ra.decorate >= 0 ? ra.decorate : conf.decorate)
         client_decorations_create(c);
 
-    client_set_title(c);
     client_refresh(c); /* using our current factoring, w/h are set incorrectly */
-    client_save(c, curr_ws);
-    client_place(c);
+    client_save(c, c->ws);
+    client_raise(c);
+    /* Windows a previous instance hid off screen have lost their position */
+    if ((!adopt && !(ra.geom_mask & (XValue | YValue))) || (adopt && (wa->x >= display_width || wa->y >= display_height))) {
+        if (c->ws == curr_ws)
+            client_place(c);
+        else
+            client_center(c);
+    }
+    if (c->ws != curr_ws && !safe_to_focus(c->ws))
+        client_hide(c);
+    if (ra.fullscreen > 0)
+        client_fullscreen(c, false, true, true);
     client_set_wm_state(c, NormalState);
     ewmh_set_desktop(c, c->ws);
     ewmh_set_client_list();
 
-    if (conf.decorate)
+    if (c->decorated)
         XMapWindow(display, c->dec);
 
     XMapWindow(display, c->window);
     XSelectInput(display, c->window, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
     window_grab_buttons(c->window);
-    client_manage_focus(c);
+    ipc_event_client(EventMap, c);
+    if (!adopt) {
+        layout_changed(c->ws);
+        /* Windows sent elsewhere by a rule do not pull the user along */
+        if (ra.focus > 0 || (ra.focus < 0 && c->ws == curr_ws))
+            client_manage_focus(c);
+    }
 }
 
 static int
-manage_xsend_icccm(struct client *c, Atom atom)
+window_type_index(Atom type)
 {
-    /* This is from a dwm patch by Brendan MacDonell:
-     * http://lists.suckless.org/dev/1104/7548.html */
+    static const int atoms[WindowLast] = {
+        [Dock] = NetWMWindowTypeDock, [Dialog] = NetWMWindowTypeDialog,
+        [Toolbar] = NetWMWindowTypeToolbar, [Menu] = NetWMWindowTypeMenu,
+        [Splash] = NetWMWindowTypeSplash, [Utility] = NetWMWindowTypeUtility,
+    };
 
+    for (int i = 0; i < WindowLast; i++)
+        if (type == net_atom[atoms[i]])
+            return i;
+
+    return WindowLast;
+}
+
+/* Add a rule given as words of the form key=value, see berryc(1). Rules
+ * matching an exact class are hashed on it, all others are kept in a
+ * pattern list with their regular expressions compiled up front, so that
+ * matching a new window costs one bucket walk and the patterns.
+ */
+static bool
+rule_add(const char *spec)
+{
+    char buf[IPC_STRING_MAX + 1], *words[RULE_MAX_WORDS];
+    struct rule *r, **list;
     int n;
-    Atom *protocols;
-    int exists = 0;
-    XEvent ev;
 
-    if (XGetWMProtocols(display, c->window, &protocols, &n)) {
-        while (!exists && n--)
-            exists = protocols[n] == atom;
-        XFree(protocols);
+    strncpy(buf, spec, sizeof buf - 1);
+    buf[sizeof buf - 1] = '\0';
+    n = split_line(buf, words, RULE_MAX_WORDS);
+    if (n <= 0)
+        return false;
+
+    r = calloc(1, sizeof *r);
+    if (r == NULL)
+        return false;
+    r->type = -1;
+    r->action = rule_action_none;
+
+    for (int i = 0; i < n; i++) {
+        char *value = words[i] + strcspn(words[i], "=~");
+        char op = *value;
+
+        if (op == '\0') {
+            LOGP("Rule word %s has no value", words[i]);
+            rule_free(r);
+            return false;
+        }
+        *value++ = '\0';
+        if (!rule_parse(r, words[i], op, value)) {
+            LOGP("Invalid rule condition or action %s", words[i]);
+            rule_free(r);
+            return false;
+        }
     }
 
-    if (exists) {
-        ev.type = ClientMessage;
-        ev.xclient.window = c->window;
-        ev.xclient.message_type = wm_atom[WMProtocols];
-        ev.xclient.format = 32;
-        ev.xclient.data.l[0] = atom;
-        ev.xclient.data.l[1] = CurrentTime;
-        XSendEvent(display, c->window, False, NoEventMask, &ev);
+    r->spec = strdup(spec);
+    if (r->spec == NULL) {
+        rule_free(r);
+        return false;
     }
+    r->seq = rule_seq++;
 
-    return exists;
+    list = r->match[RuleClass].kind == MatchExact ?
+        &rule_table[rule_hash(r->match[RuleClass].str)] : &rule_patterns;
+    while (*list != NULL)
+        list = &(*list)->next;
+    *list = r;
+    *rule_last = r;
+    rule_last = &r->after;
+
+    LOGP("Added rule %s", spec);
+    return true;
 }
 
-static void
-window_grab_buttons(Window window)
+static bool
+rule_parse(struct rule *r, const char *key, char op, const char *value)
 {
-    XGrabButton(display, conf.move_button, conf.move_mask, window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
-    XGrabButton(display, conf.resize_button, conf.resize_mask, window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
+    static const char *const fields[RuleFieldLast] = {
+        [RuleClass] = "class", [RuleInstance] = "instance", [RuleTitle] = "title",
+    };
+    struct { const char *name; int *dest; } bools[] = {
+        { "decorate", &r->action.decorate },
+        { "fullscreen", &r->action.fullscreen },
+        { "focus", &r->action.focus },
+    };
+    char *end;
+
+    for (int f = 0; f < RuleFieldLast; f++) {
+        struct rule_match *m = &r->match[f];
+        if (strcmp(key, fields[f]) != 0)
+            continue;
+        if (m->kind != MatchAny)
+            return false;
+        if (op == '~') {
+            if (regcomp(&m->re, value, REG_EXTENDED | REG_NOSUB) != 0)
+                return false;
+            m->kind = MatchRegex;
+        } else {
+            m->str = strdup(value);
+            if (m->str == NULL)
+                return false;
+            m->kind = MatchExact;
+        }
+        return true;
+    }
+
+    if (op != '=')
+        return false;
+
+    for (size_t i = 0; i < sizeof bools / sizeof bools[0]; i++) {
+        if (strcmp(key, bools[i].name) == 0) {
+            if (strcmp(value, "true") != 0 && strcmp(value, "false") != 0)
+                return false;
+            *bools[i].dest = strcmp(value, "true") == 0;
+            return true;
+        }
+    }
+
+    if (strcmp(key, "type") == 0) {
+        if (strcmp(value, "Normal") == 0) {
+            r->type = WindowLast;
+            return true;
+        }
+        for (int i = 0; i < WindowLast; i++) {
+            if (strcmp(value, window_type_names[i]) == 0) {
+                r->type = i;
+                return true;
+            }
+        }
+    } else if (strcmp(key, "workspace") == 0) {
+        r->action.ws = strtol(value, &end, 10);
+        return *value != '\0' && *end == '\0' && r->action.ws >= 0 && r->action.ws < WORKSPACE_NUMBER;
+    } else if (strcmp(key, "monitor") == 0) {
+        r->action.mon = strtol(value, &end, 10);
+        return *value != '\0' && *end == '\0' && r->action.mon >= 0;
+    } else if (strcmp(key, "geometry") == 0) {
+        r->action.geom_mask = XParseGeometry(value, &r->action.x, &r->action.y,
+                &r->action.width, &r->action.height);
+        return r->action.geom_mask != 0;
+    }
+
+    return false;
+}
+
+static void
+rule_free(struct rule *r)
+{
+    for (int f = 0; f < RuleFieldLast; f++) {
+        if (r->match[f].kind == MatchRegex)
+            regfree(&r->match[f].re);
+        free(r->match[f].str);
+    }
+    free(r->spec);
+    free(r);
+}
+
+static void
+rules_clear(void)
+{
+    struct rule *next;
+
+    for (struct rule *r = rule_list; r != NULL; r = next) {
+        next = r->after;
+        rule_free(r);
+    }
+    memset(rule_table, 0, sizeof rule_table);
+    rule_patterns = NULL;
+    rule_list = NULL;
+    rule_last = &rule_list;
+}
+
+/* Add a key binding given as "keys command arguments...", where keys are
+ * modifiers and a keysym joined by '+', see berryc(1). The command is
+ * looked up and packed here, a key press only copies the data words.
+ */
+static bool
+binding_add(const char *spec)
+{
+    char buf[IPC_STRING_MAX + 1], *words[BATCH_MAX_WORDS];
+    const struct command *c;
+    const char *str;
+    struct binding *b;
+    int n;
+
+    strncpy(buf, spec, sizeof buf - 1);
+    buf[sizeof buf - 1] = '\0';
+    n = split_line(buf, words, BATCH_MAX_WORDS);
+    if (n < 2)
+        return false;
+
+    c = command_lookup(words[1]);
+    if (c == NULL || c->cmd == IPCQuery || c->cmd == IPCSubscribe) {
+        LOGP("Cannot bind command %s", words[1]);
+        return false;
+    }
+    if (c->argc >= 0 && c->argc != n - 2) {
+        LOGP("Binding of %s expects %d arguments", c->name, c->argc);
+        return false;
+    }
+
+    b = calloc(1, sizeof *b);
+    if (b == NULL)
+        return false;
+    if (binding_list == NULL)
+        numlock_update();
+    if (!binding_parse_key(b, words[0])) {
+        LOGP("Invalid key %s", words[0]);
+        binding_free(b);
+        return false;
+    }
+    /* Key presses are matched without the num lock modifier */
+    if (b->mods & numlock_mask) {
+        LOGP("Key %s uses the num lock modifier, which bindings ignore", words[0]);
+        binding_free(b);
+        return false;
+    }
+    str = command_pack(c, b->data, n - 2, words + 2);
+    b->spec = strdup(spec);
+    b->str = str != NULL ? strdup(str) : NULL;
+    if (b->spec == NULL || (str != NULL && b->str == NULL)) {
+        binding_free(b);
+        return false;
+    }
+
+    if (!binding_grab(b)) {
+        LOGP("Key of binding %s is grabbed by another client", spec);
+        binding_free(b);
+        return false;
+    }
+    *binding_last = b;
+    binding_last = &b->after;
+
+    LOGP("Added binding %s", spec);
+    return true;
+}
+
+/* Parse modifiers and a keysym joined by '+', such as mod4+shift+Return.
+ * super and alt are accepted for mod4 and mod1, as sxhkd names them.
+ */
+static bool
+binding_parse_key(struct binding *b, char *key)
+{
+    static const struct { const char *name; unsigned int mask; } mods[] = {
+        { "shift", ShiftMask }, { "ctrl", ControlMask }, { "control", ControlMask },
+        { "mod1", Mod1Mask }, { "alt", Mod1Mask }, { "mod2", Mod2Mask },
+        { "mod3", Mod3Mask }, { "mod4", Mod4Mask }, { "super", Mod4Mask },
+        { "mod5", Mod5Mask },
+    };
+    char *word, *next;
+    size_t i;
+
+    for (word = key; (next = strchr(word, '+')) != NULL; word = next + 1) {
+        *next = '\0';
+        for (i = 0; i < sizeof mods / sizeof mods[0]; i++)
+            if (strcmp(word, mods[i].name) == 0)
+                break;
+        if (i == sizeof mods / sizeof mods[0])
+            return false;
+        b->mods |= mods[i].mask;
+    }
+
+    b->sym = XStringToKeysym(word);
+    return b->sym != NoSymbol;
+}
+
+/* Grab the key of b on the root window, whatever the state of caps lock
+ * and num lock, and file it under its keycode. Returns false, holding no
+ * grab, if another client has the key, which xerror reports in
+ * grab_failed. A key missing from the keyboard is not an error.
+ */
+static bool
+binding_grab(struct binding *b)
+{
+    unsigned int ignored[] = { 0, LockMask, numlock_mask, LockMask | numlock_mask };
+
+    b->code = XKeysymToKeycode(display, b->sym);
+    if (b->code == 0) {
+        LOGP("Key of binding %s is not on the keyboard", b->spec);
+        return true;
+    }
+    grab_failed = false;
+    for (size_t i = 0; i < sizeof ignored / sizeof ignored[0]; i++)
+        XGrabKey(display, b->code, b->mods | ignored[i], root, True, GrabModeAsync, GrabModeAsync);
+    XSync(display, False);
+    if (grab_failed) {
+        for (size_t i = 0; i < sizeof ignored / sizeof ignored[0]; i++)
+            XUngrabKey(display, b->code, b->mods | ignored[i], root);
+        b->code = 0;
+        return false;
+    }
+
+    /* Later bindings of the same keys shadow earlier ones */
+    b->next = binding_table[b->code];
+    binding_table[b->code] = b;
+    return true;
+}
+
+static void
+binding_free(struct binding *b)
+{
+    free(b->spec);
+    free(b->str);
+    free(b);
+}
+
+/* Grab every binding again, after the keyboard mapping changed */
+static void
+bindings_grab(void)
+{
+    if (binding_list == NULL)
+        return;
+    XUngrabKey(display, AnyKey, AnyModifier, root);
+    memset(binding_table, 0, sizeof binding_table);
+    numlock_update();
+    for (struct binding *b = binding_list; b != NULL; b = b->after)
+        if (!binding_grab(b))
+            LOGP("Key of binding %s is grabbed by another client", b->spec);
+}
+
+static void
+bindings_clear(void)
+{
+    struct binding *next;
+
+    if (binding_list != NULL)
+        XUngrabKey(display, AnyKey, AnyModifier, root);
+    for (struct binding *b = binding_list; b != NULL; b = next) {
+        next = b->after;
+        binding_free(b);
+    }
+    memset(binding_table, 0, sizeof binding_table);
+    binding_list = NULL;
+    binding_last = &binding_list;
+}
+
+/* Find the modifier num lock is mapped to */
+static void
+numlock_update(void)
+{
+    XModifierKeymap *map = XGetModifierMapping(display);
+    KeyCode code = XKeysymToKeycode(display, XK_Num_Lock);
+
+    stats.round_trips[StatGetModifierMapping]++;
+    numlock_mask = 0;
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < map->max_keypermod; j++)
+            if (code != 0 && map->modifiermap[i * map->max_keypermod + j] == code)
+                numlock_mask = 1 << i;
+    XFreeModifiermap(map);
+}
+
+static unsigned int
+rule_hash(const char *str)
+{
+    unsigned int h = 5381;
+
+    while (*str)
+        h = h * 33 + (unsigned char)*str++;
+
+    return h % RULE_BUCKETS;
+}
+
+static bool
+rule_match(const struct rule *r, const char *const values[RuleFieldLast], int type)
+{
+    if (r->type >= 0 && r->type != type)
+        return false;
+
+    for (int f = 0; f < RuleFieldLast; f++) {
+        const struct rule_match *m = &r->match[f];
+        if (m->kind == MatchExact && strcmp(m->str, values[f]) != 0)
+            return false;
+        if (m->kind == MatchRegex && regexec(&m->re, values[f], 0, NULL, 0) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+/* Combine the actions of every rule matching the client, the class is only
+ * fetched if there are rules at all
+ */
+static struct rule_action
+rules_apply(struct client *c, int type)
+{
+    struct rule_action a = rule_action_none;
+    XClassHint ch = { NULL, NULL };
+    const char *values[RuleFieldLast];
+    struct rule *exact, *pattern, *r;
+
+    if (rule_list == NULL)
+        return a;
+
+    stats.round_trips[StatGetWindowProperty]++;
+    XGetClassHint(display, c->window, &ch);
+    values[RuleClass] = ch.res_class ? ch.res_class : "";
+    values[RuleInstance] = ch.res_name ? ch.res_name : "";
+    values[RuleTitle] = c->title;
+    LOGP("client has class %s and instance %s", values[RuleClass], values[RuleInstance]);
+
+    /* Both lists are in definition order, merge them so later rules win */
+    exact = rule_table[rule_hash(values[RuleClass])];
+    pattern = rule_patterns;
+    while (exact != NULL || pattern != NULL) {
+        if (pattern == NULL || (exact != NULL && exact->seq < pattern->seq)) {
+            r = exact;
+            exact = exact->next;
+        } else {
+            r = pattern;
+            pattern = pattern->next;
+        }
+        if (!rule_match(r, values, type))
+            continue;
+
+        LOGP("Applying rule %s", r->spec);
+        if (r->action.ws >= 0)
+            a.ws = r->action.ws;
+        if (r->action.mon >= 0)
+            a.mon = r->action.mon;
+        if (r->action.decorate >= 0)
+            a.decorate = r->action.decorate;
+        if (r->action.fullscreen >= 0)
+            a.fullscreen = r->action.fullscreen;
+        if (r->action.focus >= 0)
+            a.focus = r->action.focus;
+        if (r->action.geom_mask & WidthValue)
+            a.width = r->action.width;
+        if (r->action.geom_mask & HeightValue)
+            a.height = r->action.height;
+        if (r->action.geom_mask & XValue) {
+            a.x = r->action.x;
+            a.geom_mask &= ~XNegative;
+        }
+        if (r->action.geom_mask & YValue) {
+            a.y = r->action.y;
+            a.geom_mask &= ~YNegative;
+        }
+        a.geom_mask |= r->action.geom_mask;
+    }
+
+    if (ch.res_class)
+        XFree(ch.res_class);
+    if (ch.res_name)
+        XFree(ch.res_name);
+
+    return a;
+}
+
+/* Size and position the client as a rule says, relative to the monitor of
+ * its workspace. Negative offsets count from the right and bottom edges.
+ */
+static void
+rule_geometry(struct client *c, const struct rule_action *a)
+{
+    int mon = ws_m_list[c->ws];
+
+    if (a->geom_mask & WidthValue)
+        c->geom.width = MAX((int)a->width, MINIMUM_DIM);
+    if (a->geom_mask & HeightValue)
+        c->geom.height = MAX((int)a->height, MINIMUM_DIM);
+    if (a->geom_mask & XValue)
+        c->geom.x = m_list[mon].x + (a->geom_mask & XNegative ? m_list[mon].width - c->geom.width + a->x : a->x);
+    if (a->geom_mask & YValue)
+        c->geom.y = m_list[mon].y + (a->geom_mask & YNegative ? m_list[mon].height - c->geom.height + a->y : a->y);
+}
+
+/* The workspace a monitor shows: the current one if it is on the monitor,
+ * else one of its workspaces with visible clients, else its first one
+ */
+static int
+monitor_workspace(int mon)
+{
+    if (ws_m_list[curr_ws] == mon)
+        return curr_ws;
+
+    for (int i = 0; i < WORKSPACE_NUMBER; i++)
+        if (ws_m_list[i] == mon && c_list[i] != NULL && !c_list[i]->hidden)
+            return i;
+
+    for (int i = 0; i < WORKSPACE_NUMBER; i++)
+        if (ws_m_list[i] == mon)
+            return i;
+
+    return curr_ws;
+}
+
+/* Adopt every top-level window that is already mapped, so that restarting
+ * berry does not leave them unmanaged until they are remapped. Xlib offers
+ * no way to pipeline the per-window replies, so unmapped and override
+ * redirect windows are dropped after the attribute query, before any
+ * property is read. Clients restored from a restart are not queried at all,
+ * they are only dropped if their window has gone away in the meantime.
+ */
+static void
+manage_existing_windows(void)
+{
+    Window dummy, *children = NULL;
+    XWindowAttributes wa;
+    unsigned int n;
+
+    if (!XQueryTree(display, root, &dummy, &dummy, &children, &n))
+        return;
+
+    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
+        struct client *next;
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = next) {
+            unsigned int j = 0;
+            next = tmp->next;
+            while (j < n && children[j] != tmp->window)
+                j++;
+            if (j == n) {
+                LOGN("Restored window is gone, dropping it");
+                if (tmp->decorated)
+                    client_decorations_destroy(tmp);
+                client_delete(tmp);
+                free(tmp);
+            }
+        }
+    }
+
+    LOGP("Adopting up to %u existing windows", n);
+    for (unsigned int i = 0; i < n; i++) {
+        if (get_client_from_window(children[i]) != NULL)
+            continue;
+        stats.round_trips[StatGetWindowAttributes]++;
+        if (!XGetWindowAttributes(display, children[i], &wa) ||
+                wa.override_redirect || wa.map_state != IsViewable)
+            continue;
+        manage_new_window(children[i], &wa, true);
+    }
+    if (children)
+        XFree(children);
+
+    /* Hide what is not on the current workspace and focus its top window,
+     * leaving the pointer where it is.
+     */
+    bool warp = conf.warp_pointer;
+    conf.warp_pointer = false;
+    switch_ws(curr_ws);
+    conf.warp_pointer = warp;
+}
+
+/* Return the workspace recorded in _NET_WM_DESKTOP, or -1 */
+static int
+window_get_desktop(Window w)
+{
+    Atom da;
+    unsigned char *prop_ret = NULL;
+    int di, ws = -1;
+    unsigned long n, dl;
+
+    stats.round_trips[StatGetWindowProperty]++;
+    if (XGetWindowProperty(display, w, net_atom[NetWMDesktop], 0, 1, False, XA_CARDINAL,
+                &da, &di, &n, &dl, &prop_ret) == Success && prop_ret) {
+        if (n > 0)
+            ws = *(unsigned long *)prop_ret;
+        XFree(prop_ret);
+    }
+
+    return ws;
+}
+
+static int
+manage_xsend_icccm(struct client *c, Atom atom)
+{
+    /* This is from a dwm patch by Brendan MacDonell:
+     * http://lists.suckless.org/dev/1104/7548.html */
+
+    int n;
+    Atom *protocols;
+    int exists = 0;
+    XEvent ev;
+
+    stats.round_trips[StatGetWMProtocols]++;
+    if (XGetWMProtocols(display, c->window, &protocols, &n)) {
+        while (!exists && n--)
+            exists = protocols[n] == atom;
+        XFree(protocols);
+    }
+
+    if (exists) {
+        ev.type = ClientMessage;
+        ev.xclient.window = c->window;
+        ev.xclient.message_type = wm_atom[WMProtocols];
+        ev.xclient.format = 32;
+        ev.xclient.data.l[0] = atom;
+        ev.xclient.data.l[1] = CurrentTime;
+        XSendEvent(display, c->window, False, NoEventMask, &ev);
+    }
+
+    return exists;
+}
+
+static void
+window_grab_buttons(Window window)
+{
+    XGrabButton(display, conf.move_button, conf.move_mask, window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
+    XGrabButton(display, conf.resize_button, conf.resize_mask, window, True, ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
     if (conf.focus_on_click)
         XGrabButton(display, conf.focus_button, AnyModifier, window, True, ButtonPressMask, GrabModeSync, GrabModeSync, None, None);
 }
@@ -1554,7 +3396,9 @@ client_move_absolute(struct client *c, int x, int y)
     if (c->mono)
         c->mono = false;
 
+    edges_touch(c);
     client_set_status(c);
+    ipc_event_client(EventMove, c);
 }
 
 static void
@@ -1590,58 +3434,78 @@ client_move_relative(struct client *c, int x, int y)
     }
 }
 
-static bool
-client_window_is_below(struct client *c)
+/* The layer a client is stacked in, which is only read from the window
+ * when it is managed and afterwards follows berryc and EWMH requests
+ */
+static int
+window_get_layer(Window w)
 {
-    Atom prop, da;
+    Atom da;
     unsigned char *prop_ret = NULL;
-    int di;
+    int di, layer = LayerNormal;
     unsigned long dl, dn;
 
-    if (XGetWindowProperty(display, c->window, net_atom[NetWMState], 0,
+    stats.round_trips[StatGetWindowProperty]++;
+    if (XGetWindowProperty(display, w, net_atom[NetWMState], 0,
                 sizeof (Atom), False, XA_ATOM, &da, &di, &dn, &dl,
-                &prop_ret) == Success)
-    {
+                &prop_ret) == Success && prop_ret) {
         Atom *states = (Atom *)prop_ret;
         for (unsigned long i = 0; i < dn; i++) {
-            if (states[i] == net_atom[NetWMStateBelow]) {
-                XFree(prop_ret);
-                return true;
-            }
+            if (states[i] == net_atom[NetWMStateBelow])
+                layer = LayerBelow;
+            else if (states[i] == net_atom[NetWMStateAbove])
+                layer = LayerAbove;
         }
     }
-    XFree(prop_ret);
-    return false;
+    if (prop_ret)
+        XFree(prop_ret);
+    return layer;
+}
+
+static int
+client_layer(struct client *c)
+{
+    return c->fullscreen ? LayerFullscreen : c->layer;
 }
 
+/* Insert a client in front of every other client of its layer */
 static void
-client_move_to_front(struct client *c)
+client_stack_insert(struct client *c)
 {
-    int ws;
-    ws = c->ws;
+    struct client **p = &c_list[c->ws];
 
-    /* If we didn't find the client */
-    if (ws == -1)
-        return;
+    while (*p != NULL && client_layer(*p) > client_layer(c))
+        p = &(*p)->next;
+    c->next = *p;
+    *p = c;
+}
 
+static void
+client_move_to_front(struct client *c)
+{
+    struct client **p;
 
-    /* If the Client is set to be always below */
-    if (client_window_is_below(c))
+    /* If we didn't find the client */
+    if (c->ws == -1)
         return;
 
-    /* If the Client is at the front of the list, ignore command */
-    if (c_list[ws] == c || c_list[ws]->next == NULL)
+    for (p = &c_list[c->ws]; *p != NULL && *p != c; p = &(*p)->next)
+        ;
+    if (*p == NULL)
         return;
 
-    struct client *tmp;
-    for (tmp = c_list[ws]; tmp->next != NULL; tmp = tmp->next)
-        if (tmp->next == c)
-            break;
+    *p = c->next; /* remove the Client from the list */
+    client_stack_insert(c);
+}
 
-    if (tmp && tmp->next)
-        tmp->next = tmp->next->next; /* remove the Client from the list */
-    c->next = c_list[ws]; /* add the client to the front of the list */
-    c_list[ws] = c;
+static void
+client_set_layer(struct client *c, int layer)
+{
+    c->layer = layer;
+    ewmh_set_state(c);
+    client_move_to_front(c);
+    client_raise(c);
+    ipc_event_client(EventState, c);
 }
 
 static void
@@ -1661,6 +3525,7 @@ client_monocle(struct client *c)
         client_resize_absolute(c, m_list[mon].width - conf.right_gap - conf.left_gap, m_list[mon].height - conf.top_gap - conf.bot_gap);
         c->mono = true;
     }
+    ipc_event_client(EventState, c);
 }
 
 static void
@@ -1763,206 +3628,1347 @@ client_place(struct client *c)
             count = 0;
         }
     }
-    // Center the client if there is no space for it
-    client_center(c);
+    // Center the client if there is no space for it
+    client_center(c);
+}
+
+/* Bring the stacking order of a client's windows in line with its place in
+ * the client list. Every other client is assumed to be stacked already, so
+ * only the moved client is configured, directly below the client before it
+ * or, at the head of the list, on top of the whole stack, with its
+ * decoration right underneath.
+ */
+static void
+client_raise(struct client *c)
+{
+    struct client *prev = NULL;
+    XWindowChanges wc;
+
+    if (c == NULL)
+        return;
+
+    for (struct client *tmp = c_list[c->ws]; tmp != NULL && tmp != c; tmp = tmp->next)
+        prev = tmp;
+
+    if (prev != NULL) {
+        wc.sibling = prev->decorated ? prev->dec : prev->window;
+        wc.stack_mode = Below;
+        XConfigureWindow(display, c->window, CWSibling|CWStackMode, &wc);
+    } else {
+        /* Above docks, bars and unmanaged windows as well */
+        XRaiseWindow(display, c->window);
+    }
+
+    if (c->decorated) {
+        wc.sibling = c->window;
+        wc.stack_mode = Below;
+        XConfigureWindow(display, c->dec, CWSibling|CWStackMode, &wc);
+    }
+}
+
+/* Listen for RandR layout changes if the server supports RandR 1.5, which
+ * introduced monitors. Otherwise randr_base stays -1 and Xinerama is used.
+ */
+static void
+randr_setup(void)
+{
+    int event_base, error_base, major, minor;
+
+    if (!XRRQueryExtension(display, &event_base, &error_base) ||
+            !XRRQueryVersion(display, &major, &minor) ||
+            major < 1 || (major == 1 && minor < 5)) {
+        LOGN("RandR 1.5 not available, falling back to Xinerama");
+        return;
+    }
+
+    randr_base = event_base;
+    XRRSelectInput(display, root, RRScreenChangeNotifyMask|RROutputChangeNotifyMask|RRCrtcChangeNotifyMask);
+}
+
+/* Read the current monitor layout into a newly allocated list and return
+ * the number of monitors. RandR 1.5 monitors are preferred since mirrored
+ * outputs are already merged into one monitor there, Xinerama is the
+ * fallback and a single monitor covering the screen the last resort.
+ */
+static int
+monitors_query(struct monitor **list)
+{
+    XRRMonitorInfo *rr_info;
+    XineramaScreenInfo *m_info;
+    int n = 0;
+
+    if (randr_base >= 0 && (rr_info = XRRGetMonitors(display, root, True, &n)) != NULL) {
+        *list = n > 0 ? malloc(sizeof(struct monitor) * n) : NULL;
+        for (int i = 0; *list != NULL && i < n; i++) {
+            (*list)[i].screen = i;
+            (*list)[i].x = rr_info[i].x;
+            (*list)[i].y = rr_info[i].y;
+            (*list)[i].width = rr_info[i].width;
+            (*list)[i].height = rr_info[i].height;
+        }
+        XRRFreeMonitors(rr_info);
+        if (*list != NULL)
+            return n;
+    }
+
+    if (XineramaIsActive(display) && (m_info = XineramaQueryScreens(display, &n)) != NULL) {
+        *list = n > 0 ? malloc(sizeof(struct monitor) * n) : NULL;
+        for (int i = 0; *list != NULL && i < n; i++) {
+            (*list)[i].screen = m_info[i].screen_number;
+            (*list)[i].x = m_info[i].x_org;
+            (*list)[i].y = m_info[i].y_org;
+            (*list)[i].width = m_info[i].width;
+            (*list)[i].height = m_info[i].height;
+        }
+        XFree(m_info);
+        if (*list != NULL)
+            return n;
+    }
+
+    LOGN("Could not query monitors, using the whole screen");
+    *list = malloc(sizeof(struct monitor));
+    if (*list == NULL)
+        return 0;
+    (*list)[0] = (struct monitor) { 0, 0, display_width, display_height, 0 };
+    return 1;
+}
+
+/* Refresh m_list from the server. Nothing else is touched unless the layout
+ * actually changed, in which case the clients on every monitor that moved,
+ * resized or disappeared are brought back inside it in one pass.
+ */
+static void
+monitors_update(void)
+{
+    struct monitor *list;
+    int n, old_count;
+
+    monitors_dirty = false;
+    n = monitors_query(&list);
+    if (n == 0) {
+        LOGN("Could not allocate monitors, keeping the previous layout");
+        return;
+    }
+    if (n == m_count && memcmp(list, m_list, sizeof(struct monitor) * n) == 0) {
+        free(list);
+        return;
+    }
+
+    LOGP("Found %d screens active", n);
+    bool affected[n];
+    for (int i = 0; i < n; i++) {
+        affected[i] = i >= m_count || memcmp(&list[i], &m_list[i], sizeof(struct monitor)) != 0;
+        LOGP("Screen #%d with dim: x=%d y=%d w=%d h=%d",
+                list[i].screen, list[i].x, list[i].y, list[i].width, list[i].height);
+    }
+
+    old_count = m_count;
+    free(m_list);
+    m_list = list;
+    m_count = n;
+
+    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
+        if (ws_m_list[i] >= m_count) {
+            ws_m_list[i] = 0;
+            affected[0] = true;
+        }
+    }
+
+    if (old_count > 0) {
+        for (int i = 0; i < WORKSPACE_NUMBER; i++)
+            for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+                if (affected[ws_m_list[i]])
+                    client_monitor_clamp(tmp);
+    }
+
+    edges_invalidate();
+    ewmh_set_viewport();
+}
+
+/* Snapping looks edges up in a sorted index per monitor. It is rebuilt
+ * on the next lookup after a client other than the one being dragged
+ * changed, so a drag on its own never rebuilds it.
+ */
+static void
+edges_invalidate(void)
+{
+    for (int i = 0; i < edge_index_count; i++)
+        edge_index[i].dirty = true;
+}
+
+static void
+edges_touch(struct client *c)
+{
+    if (c != drag.client)
+        edges_invalidate();
+}
+
+static struct edge_index *
+edges_get(int mon)
+{
+    struct edge_index *idx;
+    int n = 0;
+
+    if (edge_index_count != m_count) {
+        for (int i = 0; i < edge_index_count; i++) {
+            free(edge_index[i].v);
+            free(edge_index[i].h);
+        }
+        free(edge_index);
+        edge_index = calloc(m_count, sizeof *edge_index);
+        edge_index_count = edge_index ? m_count : 0;
+        edges_invalidate();
+    }
+    if (mon < 0 || mon >= edge_index_count)
+        return NULL;
+
+    idx = &edge_index[mon];
+    if (!idx->dirty)
+        return idx;
+
+    /* Two edges per axis for the monitor and every visible frame on it */
+    for (int i = 0; i < WORKSPACE_NUMBER; i++)
+        if (ws_m_list[i] == mon)
+            for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+                n++;
+    if (n + 1 > idx->cap) {
+        struct edge *v = realloc(idx->v, 2 * (n + 1) * sizeof *v);
+        struct edge *h = v ? realloc(idx->h, 2 * (n + 1) * sizeof *h) : NULL;
+        if (v)
+            idx->v = v;
+        if (h == NULL)
+            return NULL;
+        idx->h = h;
+        idx->cap = n + 1;
+    }
+
+    idx->nv = idx->nh = 0;
+    edges_add(idx, m_list[mon].x + conf.left_gap, m_list[mon].y + conf.top_gap,
+            m_list[mon].width - conf.left_gap - conf.right_gap,
+            m_list[mon].height - conf.top_gap - conf.bot_gap);
+    for (int i = 0; i < WORKSPACE_NUMBER; i++)
+        if (ws_m_list[i] == mon)
+            for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+                if (!tmp->hidden && tmp != drag.client)
+                    edges_add(idx, tmp->geom.x, tmp->geom.y, tmp->geom.width, tmp->geom.height);
+    qsort(idx->v, idx->nv, sizeof *idx->v, edge_cmp);
+    qsort(idx->h, idx->nh, sizeof *idx->h, edge_cmp);
+    idx->dirty = false;
+    LOGP("Indexed %d edges on monitor %d", idx->nv, mon);
+
+    return idx;
+}
+
+static void
+edges_add(struct edge_index *idx, int x, int y, int w, int h)
+{
+    idx->v[idx->nv++] = (struct edge){ x, y, y + h };
+    idx->v[idx->nv++] = (struct edge){ x + w, y, y + h };
+    idx->h[idx->nh++] = (struct edge){ y, x, x + w };
+    idx->h[idx->nh++] = (struct edge){ y + h, x, x + w };
+}
+
+static int
+edge_cmp(const void *a, const void *b)
+{
+    const struct edge *ea = a, *eb = b;
+
+    return (ea->pos > eb->pos) - (ea->pos < eb->pos);
+}
+
+/* Binary search for edges within snap_distance of pos which overlap
+ * [from, to), keeping the closest offset in *best if it beats it
+ */
+static void
+edge_nearest(const struct edge *e, int n, int pos, int from, int to, int *best)
+{
+    int lo = 0, hi = n;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (e[mid].pos < pos - conf.snap_distance)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (int i = lo; i < n && e[i].pos <= pos + conf.snap_distance; i++)
+        if (e[i].from < to && e[i].to > from && abs(e[i].pos - pos) < abs(*best))
+            *best = e[i].pos - pos;
+}
+
+/* Pull the frame at x, y against the nearest edge on each axis */
+static void
+edge_snap_move(struct client *c, int *x, int *y)
+{
+    struct edge_index *idx = edges_get(ws_m_list[c->ws]);
+    int dx = conf.snap_distance + 1, dy = conf.snap_distance + 1;
+
+    if (idx == NULL)
+        return;
+
+    edge_nearest(idx->v, idx->nv, *x, *y, *y + c->geom.height, &dx);
+    edge_nearest(idx->v, idx->nv, *x + c->geom.width, *y, *y + c->geom.height, &dx);
+    edge_nearest(idx->h, idx->nh, *y, *x, *x + c->geom.width, &dy);
+    edge_nearest(idx->h, idx->nh, *y + c->geom.height, *x, *x + c->geom.width, &dy);
+
+    if (dx <= conf.snap_distance)
+        *x += dx;
+    if (dy <= conf.snap_distance)
+        *y += dy;
+}
+
+/* Pull the right and bottom edges of a frame being resized */
+static void
+edge_snap_resize(struct client *c, int *w, int *h)
+{
+    struct edge_index *idx = edges_get(ws_m_list[c->ws]);
+    int dw = conf.snap_distance + 1, dh = conf.snap_distance + 1;
+
+    if (idx == NULL)
+        return;
+
+    edge_nearest(idx->v, idx->nv, c->geom.x + *w, c->geom.y, c->geom.y + *h, &dw);
+    edge_nearest(idx->h, idx->nh, c->geom.y + *h, c->geom.x, c->geom.x + *w, &dh);
+
+    if (dw <= conf.snap_distance)
+        *w += dw;
+    if (dh <= conf.snap_distance)
+        *h += dh;
+}
+
+/* Bring a client back inside its monitor after the monitor layout changed.
+ * Hidden clients keep their place off screen, only their saved position is
+ * adjusted.
+ */
+static void
+client_monitor_clamp(struct client *c)
+{
+    struct monitor *m = &m_list[ws_m_list[c->ws]];
+    int x, y;
+
+    if (c->fullscreen && conf.fs_max) {
+        client_resize_absolute(c, m->width, m->height);
+        x = m->x;
+        y = m->y;
+    } else {
+        x = c->hidden ? c->x_hide : c->geom.x;
+        x = MAX(m->x, MIN(x, m->x + m->width - c->geom.width));
+        y = MAX(m->y, MIN(c->geom.y, m->y + m->height - c->geom.height));
+    }
+
+    if (c->hidden) {
+        c->x_hide = x;
+        x = display_width + conf.b_width;
+    }
+
+    if (x != c->geom.x || y != c->geom.y)
+        client_move_absolute(c, x, y);
+}
+
+static void
+client_refresh(struct client *c)
+{
+    LOGN("Refreshing client");
+    for (int i = 0; i < 2; i++) {
+        client_move_relative(c, 0, 0);
+        client_resize_relative(c, 0, 0);
+    }
+}
+
+/* Reposition a client's window inside its unchanged frame after the border,
+ * inner border or title sizes changed
+ */
+static void
+client_relayout(struct client *c)
+{
+    if (!c->decorated)
+        return;
+
+    XSetWindowBorderWidth(display, c->dec, conf.b_width);
+    client_configure(c);
+    ewmh_set_frame_extents(c);
+}
+
+/* Place a decorated client's frame and window at its current geometry */
+static void
+client_configure(struct client *c)
+{
+    XMoveResizeWindow(display, c->dec, c->geom.x, c->geom.y,
+            MAX(c->geom.width - 2 * conf.b_width, MINIMUM_DIM),
+            MAX(c->geom.height - 2 * conf.b_width, MINIMUM_DIM));
+    XMoveResizeWindow(display, c->window,
+            c->geom.x + conf.i_width + conf.b_width,
+            c->geom.y + conf.i_width + conf.b_width + conf.t_height,
+            MAX(c->geom.width - 2 * (conf.i_width + conf.b_width), MINIMUM_DIM),
+            MAX(c->geom.height - 2 * (conf.i_width + conf.b_width) - conf.t_height, MINIMUM_DIM));
+}
+
+/* Apply every setting changed since the last call, once per batch of
+ * events, using the narrowest update for each: colors only repaint the
+ * decoration, sizes move windows inside their frame, and gaps re-clamp
+ * visible clients. Decorations are never recreated.
+ */
+static void
+refresh_config(void)
+{
+    unsigned int dirty = config_dirty;
+
+    config_dirty = 0;
+    LOGP("Refreshing config, dirty mask %u", dirty);
+    if (dirty & (DirtyGaps|DirtyLayout))
+        edges_invalidate();
+
+    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
+            if (dirty & DirtyLayout)
+                client_relayout(tmp);
+
+            if ((dirty & DirtyGaps) && conf.edge_lock && !tmp->hidden && !tmp->fullscreen) {
+                client_move_relative(tmp, 0, 0);
+                client_resize_relative(tmp, 0, 0);
+            }
+
+            if (!tmp->decorated)
+                continue;
+
+            if (dirty & DirtyColor) {
+                if (f_client != tmp)
+                    client_set_color(tmp, conf.iu_color, conf.bu_color);
+                else
+                    client_set_color(tmp, conf.if_color, conf.bf_color);
+            } else if (dirty & (DirtyText|DirtyLayout)) {
+                if (!conf.draw_text)
+                    XClearWindow(display, tmp->dec);
+                draw_text(tmp, tmp == f_client);
+            }
+
+            if (dirty & (DirtyStatus|DirtyLayout))
+                client_set_status(tmp);
+        }
+    }
+}
+
+static void
+client_resize_absolute(struct client *c, int w, int h)
+{
+    int dw = w;
+    int dh = h;
+    int dec_w = w;
+    int dec_h = h;
+
+    if (c->decorated) {
+        dw = w - (2 * conf.i_width) - (2 * conf.b_width);
+        dh = h - (2 * conf.i_width) - (2 * conf.b_width) - conf.t_height;
+
+        dec_w = w - (2 * conf.b_width);
+        dec_h = h - (2 * conf.b_width);
+    }
+
+    /*LOGN("Resizing client main window");*/
+    XResizeWindow(display, c->window, MAX(dw, MINIMUM_DIM), MAX(dh, MINIMUM_DIM));
+    if (c->decorated) {
+        /*LOGN("Resizing client decoration");*/
+        XResizeWindow(display, c->dec, MAX(dec_w, MINIMUM_DIM), MAX(dec_h, MINIMUM_DIM));
+    }
+
+    c->geom.width = MAX(w, MINIMUM_DIM);
+    c->geom.height = MAX(h, MINIMUM_DIM);
+    if (c->mono)
+        c->mono = false;
+    edges_touch(c);
+    client_set_status(c);
+    ipc_event_client(EventResize, c);
+}
+
+/* Move and resize a client with a single configure request per window,
+ * used when many clients are rearranged at once
+ */
+static void
+client_move_resize(struct client *c, int x, int y, int w, int h)
+{
+    c->geom.x = x;
+    c->geom.y = y;
+    c->geom.width = MAX(w, MINIMUM_DIM);
+    c->geom.height = MAX(h, MINIMUM_DIM);
+    c->mono = false;
+
+    if (c->decorated)
+        client_configure(c);
+    else
+        XMoveResizeWindow(display, c->window, x, y, c->geom.width, c->geom.height);
+
+    edges_touch(c);
+    client_set_status(c);
+    ipc_event_client(EventMove, c);
+    ipc_event_client(EventResize, c);
+}
+
+/* Split length into n parts and return the offset of part i, so that the
+ * parts cover length exactly without accumulating rounding errors
+ */
+static int
+layout_split(int length, int n, int i)
+{
+    return (int)((long)length * i / n);
+}
+
+/* Tile the clients of a workspace according to its layout. Every rectangle
+ * is computed first from the monitor and the gaps, then each client gets
+ * one configure request. Fullscreen clients are left alone. A workspace that
+ * is not shown is arranged the next time it is switched to.
+ */
+static void
+layout_apply(int ws)
+{
+    int n, mon, ax, ay, aw, ah, cols, rows, mw;
+
+    if (ws_layout[ws] == LayoutFloating)
+        return;
+
+    n = 0;
+    for (struct client *tmp = c_list[ws]; tmp != NULL; tmp = tmp->next) {
+        if (tmp->hidden) {
+            layout_pending[ws] = true;
+            return;
+        }
+        if (!tmp->fullscreen)
+            n++;
+    }
+
+    layout_pending[ws] = false;
+    if (n == 0)
+        return;
+
+    /* Newest client first, so that it becomes the master */
+    struct client *tiled[n];
+    n = 0;
+    for (struct client *tmp = c_list[ws]; tmp != NULL; tmp = tmp->next) {
+        if (tmp->fullscreen)
+            continue;
+        int j = n++;
+        for (; j > 0 && tiled[j-1]->seq < tmp->seq; j--)
+            tiled[j] = tiled[j-1];
+        tiled[j] = tmp;
+    }
+
+    mon = ws_m_list[ws];
+    ax = m_list[mon].x + conf.left_gap;
+    ay = m_list[mon].y + conf.top_gap;
+    aw = m_list[mon].width - conf.left_gap - conf.right_gap;
+    ah = m_list[mon].height - conf.top_gap - conf.bot_gap;
+
+    struct client_geom g[n];
+    switch (ws_layout[ws]) {
+        case LayoutMaster:
+            mw = n == 1 ? aw : aw * MASTER_PERCENT / 100;
+            g[0] = (struct client_geom){ax, ay, mw, ah};
+            for (int i = 1; i < n; i++) {
+                int y0 = layout_split(ah, n - 1, i - 1);
+                int y1 = layout_split(ah, n - 1, i);
+                g[i] = (struct client_geom){ax + mw, ay + y0, aw - mw, y1 - y0};
+            }
+            break;
+        case LayoutGrid:
+            for (cols = 1; cols * cols < n; cols++)
+                ;
+            rows = (n + cols - 1) / cols;
+            for (int i = 0; i < n; i++) {
+                int r = i / cols;
+                /* The last row spreads its clients over the full width */
+                int in_row = r == rows - 1 ? n - r * cols : cols;
+                int c = i % cols;
+                int x0 = layout_split(aw, in_row, c), x1 = layout_split(aw, in_row, c + 1);
+                int y0 = layout_split(ah, rows, r), y1 = layout_split(ah, rows, r + 1);
+                g[i] = (struct client_geom){ax + x0, ay + y0, x1 - x0, y1 - y0};
+            }
+            break;
+        case LayoutColumns:
+            for (int i = 0; i < n; i++) {
+                int x0 = layout_split(aw, n, i), x1 = layout_split(aw, n, i + 1);
+                g[i] = (struct client_geom){ax + x0, ay, x1 - x0, ah};
+            }
+            break;
+        default:
+            return;
+    }
+
+    LOGP("Arranging %d clients on workspace %d", n, ws);
+    for (int i = 0; i < n; i++)
+        client_move_resize(tiled[i], g[i].x, g[i].y, g[i].width, g[i].height);
+}
+
+/* Rearrange a workspace after a client joined or left it */
+static void
+layout_changed(int ws)
+{
+    if (conf.auto_layout)
+        layout_apply(ws);
+}
+
+static void
+client_resize_relative(struct client *c, int w, int h)
+{
+    if (conf.edge_lock) {
+        int dw, dh, mon;
+        mon = ws_m_list[c->ws];
+
+        /* First, check if the resize will exceed the dimensions set by
+         * the right side of the given monitor. If they do, cap the resize
+         * amount to move only to the edge of the monitor.
+         */
+        if (c->geom.x + c->geom.width + w > m_list[mon].x + m_list[mon].width - conf.right_gap)
+            dw = m_list[mon].x + m_list[mon].width - c->geom.x - conf.right_gap;
+        else
+            dw = c->geom.width + w;
+
+        /* Next, check if the resize will exceed the dimensions set by
+         * the bottom side of the given monitor. If they do, cap the resize
+         * amount to move only to the edge of the monitor.
+         */
+        if (c->geom.y + c->geom.height + conf.t_height + h > m_list[mon].y + m_list[mon].height - conf.bot_gap)
+            dh = m_list[mon].height + m_list[mon].y - c->geom.y - conf.bot_gap;
+        else
+            dh = c->geom.height + h;
+
+        client_resize_absolute(c, dw, dh);
+    } else {
+        client_resize_absolute(c, c->geom.width + w, c->geom.height + h);
+    }
+}
+
+/* Handle every X event that is currently available without blocking */
+static void
+run_x_events(void)
+{
+    XEvent e;
+    int queued;
+    unsigned long req, rt, start;
+
+    while (running && XPending(display)) {
+        XNextEvent(display, &e);
+        LOGP("Received new %d event", e.type);
+        queued = XEventsQueued(display, QueuedAlready);
+        stats.queue_max = MAX(stats.queue_max, queued);
+        start = record_now();
+        req = NextRequest(display);
+        rt = stats_round_trips();
+        if (e.type < LASTEvent && event_handler[e.type]) {
+            LOGP("Handling %d event", e.type);
+            event_handler[e.type](&e);
+            stats.requests[e.type] += NextRequest(display) - req;
+        } else if (randr_base >= 0 && (e.type == randr_base + RRScreenChangeNotify || e.type == randr_base + RRNotify)) {
+            handle_randr_notify(&e);
+        }
+        if (e.type < LASTEvent)
+            stats.events[e.type]++;
+        record_add(e.type, e.xany.window, start, NextRequest(display) - req, stats_round_trips() - rt);
+    }
+}
+
+/* berry waits in epoll on the X connection, the IPC sockets, a timerfd armed
+ * for the earliest timer on the wheel and a signalfd. Handlers only mark
+ * work as dirty or queue a timer, the work is done once per batch below.
+ */
+static void
+run(void)
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    int n, due;
+
+    XSync(display, false);
+    while (running) {
+        run_x_events();
+        timer_run(&timers, record_now() / 1000);
+        if (drag.pending)
+            drag_update();
+        if (titles_dirty && (due = titles_refresh()) >= 0)
+            timer_add(&timers, &title_timer, record_now() / 1000 + due);
+        if (pub_queued)
+            publish_wakeup();
+        if (record_dump_pending)
+            record_dump();
+        if (monitors_dirty)
+            record_work(WorkMonitorsUpdate, monitors_update);
+        if (config_dirty)
+            record_work(WorkRefreshConfig, refresh_config);
+        if (query_count > 0)
+            queries_answer();
+        if (!running)
+            break;
+
+        /* The work above may have read events into the queue of Xlib,
+         * where epoll cannot see them. XPending also flushes our requests.
+         */
+        if (XPending(display))
+            continue;
+
+        reactor_arm();
+        reactor_watch_output();
+        n = epoll_wait(reactor_fd, events, REACTOR_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                LOGN("epoll_wait failed");
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+            reactor_dispatch(&events[i]);
+    }
+}
+
+/* Block the signals berry handles and create the epoll set with the X
+ * connection, the timerfd and the signalfd. The IPC sockets are added as
+ * they are opened. berry cannot run without these.
+ */
+static void
+reactor_setup(void)
+{
+    sigemptyset(&reactor_signals);
+    sigaddset(&reactor_signals, SIGTERM);
+    sigaddset(&reactor_signals, SIGINT);
+    sigaddset(&reactor_signals, SIGHUP);
+    sigaddset(&reactor_signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &reactor_signals, NULL);
+
+    reactor_fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    signal_fd = signalfd(-1, &reactor_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (reactor_fd < 0 || timer_fd < 0 || signal_fd < 0 ||
+            reactor_ctl(EPOLL_CTL_ADD, ConnectionNumber(display), EPOLLIN, SourceX) < 0 ||
+            reactor_ctl(EPOLL_CTL_ADD, timer_fd, EPOLLIN, SourceTimer) < 0 ||
+            reactor_ctl(EPOLL_CTL_ADD, signal_fd, EPOLLIN, SourceSignal) < 0) {
+        fprintf(stderr, "%s: could not set up the event loop: %s\n", __WINDOW_MANAGER_NAME__, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    timer_wheel_init(&timers, record_now() / 1000);
+    title_timer.fn = timer_wake;
+    drag_timer.fn = timer_wake;
+}
+
+static int
+reactor_ctl(int op, int fd, unsigned int events, unsigned int source)
+{
+    struct epoll_event ev = { .events = events, .data.u32 = source };
+
+    return epoll_ctl(reactor_fd, op, fd, &ev);
+}
+
+/* Arm the timerfd for the next tick the wheel has work for */
+static void
+reactor_arm(void)
+{
+    struct itimerspec its = { 0 };
+    long next = timer_next(&timers), us;
+
+    /* next counts from the wheel's next tick, which timer_run only runs
+     * once the clock has reached it, so wait for that moment itself
+     */
+    if (next >= 0) {
+        us = (long)((timers.now + next) * 1000 - record_now());
+        if (us > 0) {
+            its.it_value.tv_sec = us / 1000000;
+            its.it_value.tv_nsec = (us % 1000000) * 1000;
+        } else {
+            its.it_value.tv_nsec = 1; /* a zero value would disarm it */
+        }
+    }
+    timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+/* Watch for writability only where output is waiting, the IPC connections
+ * with replies or events left and stderr with debug log records.
+ */
+static void
+reactor_watch_output(void)
+{
+    for (int i = 0; i < IPC_MAX_CONNS; i++) {
+        struct ipc_conn *conn = &ipc_conns[i];
+        unsigned int want = EPOLLIN | (conn->out.len > 0 ? EPOLLOUT : 0);
+
+        if (conn->fd >= 0 && conn->watched != want) {
+            reactor_ctl(EPOLL_CTL_MOD, conn->fd, want, SourceConn + i);
+            conn->watched = want;
+        }
+    }
+
+    if (log_pending() && log_watch == 0) {
+        /* epoll refuses regular files, which never block anyway */
+        log_watch = reactor_ctl(EPOLL_CTL_ADD, STDERR_FILENO, EPOLLOUT, SourceLog) < 0 ? -1 : 1;
+    } else if (!log_pending() && log_watch == 1) {
+        reactor_ctl(EPOLL_CTL_DEL, STDERR_FILENO, 0, SourceLog);
+        log_watch = 0;
+    }
+    if (log_watch < 0 && log_pending())
+        log_flush(STDERR_FILENO);
+}
+
+/* SIGUSR1 dumps the flight recorder, the others shut berry down through
+ * close_wm
+ */
+static void
+reactor_signal(void)
+{
+    struct signalfd_siginfo si;
+
+    while (read(signal_fd, &si, sizeof si) == sizeof si) {
+        if (si.ssi_signo == SIGUSR1) {
+            record_dump_pending = true;
+        } else {
+            LOGP("Received signal %u, shutting down", si.ssi_signo);
+            running = false;
+        }
+    }
+}
+
+static void
+reactor_dispatch(struct epoll_event *ev)
+{
+    uint64_t expirations;
+    unsigned int source = ev->data.u32;
+
+    switch (source) {
+        case SourceX:
+            /* read by run_x_events with the next pass */
+            break;
+        case SourceTimer:
+            if (read(timer_fd, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+                LOGN("Could not read the timerfd");
+            break;
+        case SourceSignal:
+            reactor_signal();
+            break;
+        case SourceIPC:
+            ipc_socket_accept();
+            break;
+        case SourceLog:
+            log_flush(STDERR_FILENO);
+            break;
+        default:
+            if (source - SourceConn < IPC_MAX_CONNS) {
+                struct ipc_conn *conn = &ipc_conns[source - SourceConn];
+                if (conn->fd >= 0 && ev->events & EPOLLOUT)
+                    ipc_conn_flush(conn);
+                if (conn->fd >= 0 && ev->events & ~EPOLLOUT)
+                    ipc_conn_read(conn);
+            }
+            break;
+    }
+}
+
+/* For timers which only have to bring run() round again, the work itself
+ * is picked up there through a dirty flag.
+ */
+static void
+timer_wake(void *arg)
+{
+    UNUSED(arg);
+}
+
+static unsigned long
+record_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Remember a handled event or command in the flight recorder. This runs for
+ * everything berry does, so it only fills one slot of the ring; a handler
+ * slower than slow_threshold ms schedules a dump for the end of the batch.
+ */
+static void
+record_add(unsigned int type, unsigned long window, unsigned long start, unsigned long requests, unsigned long round_trips)
+{
+    struct record *r = &record[record_head++ & (RECORD_SIZE - 1)];
+    unsigned long now = record_now();
+
+    r->time = start;
+    r->window = window;
+    r->duration = now - start;
+    r->type = type;
+    r->requests = MIN(requests, USHRT_MAX);
+    r->round_trips = MIN(round_trips, USHRT_MAX);
+
+    if (conf.slow_threshold > 0 && r->duration >= (unsigned int)conf.slow_threshold * 1000 &&
+            now - record_dumped >= RECORD_DUMP_INTERVAL)
+        record_dump_pending = true;
+}
+
+/* Run deferred work and record it like a handler */
+static void
+record_work(enum record_work work, void (*fn)(void))
+{
+    unsigned long start = record_now(), req = NextRequest(display), rt = stats_round_trips();
+
+    fn();
+    record_add(work | RECORD_WORK, None, start, NextRequest(display) - req, stats_round_trips() - rt);
+}
+
+static unsigned long
+stats_round_trips(void)
+{
+    unsigned long n = 0;
+
+    for (int i = 0; i < StatLast; i++)
+        n += stats.round_trips[i];
+
+    return n;
+}
+
+/* Write the flight recorder, oldest entry first, to
+ * $XDG_RUNTIME_DIR/berry-$DISPLAY.record, one entry per line: start and
+ * duration in us, x, ipc or work, the event type, command or work, window,
+ * and the number of X requests and of round trips issued.
+ */
+static void
+record_dump(void)
+{
+    char path[PATH_MAX];
+    unsigned long first;
+    FILE *f;
+
+    record_dump_pending = false;
+    record_dumped = record_now();
+
+    if (ipc_runtime_path(path, sizeof path, DisplayString(display), "record") < 0) {
+        LOGN("No runtime directory, cannot dump the flight recorder");
+        return;
+    }
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        LOGP("Could not open %s", path);
+        return;
+    }
+
+    first = record_head > RECORD_SIZE ? record_head - RECORD_SIZE : 0;
+    for (unsigned long i = first; i < record_head; i++) {
+        struct record *r = &record[i & (RECORD_SIZE - 1)];
+        if (r->type & RECORD_IPC) {
+            const char *name = command_name(r->type & ~(RECORD_IPC | RECORD_CONFIG), r->type & RECORD_CONFIG);
+            fprintf(f, "%lu %u ipc %s 0x%lx %u %u\n", r->time, r->duration, name, r->window,
+                    r->requests, r->round_trips);
+        } else if (r->type & RECORD_WORK) {
+            fprintf(f, "%lu %u work %s 0x%lx %u %u\n", r->time, r->duration,
+                    work_names[r->type & ~RECORD_WORK], r->window, r->requests, r->round_trips);
+        } else {
+            fprintf(f, "%lu %u x %u 0x%lx %u %u\n", r->time, r->duration, r->type, r->window,
+                    r->requests, r->round_trips);
+        }
+    }
+    fclose(f);
+    LOGP("Dumped %lu flight recorder entries to %s", record_head - first, path);
 }
 
+/* Write a property that berry never reads back. When the worker runs the
+ * write is queued for it, so that status consumers never slow down input
+ * handling. Writes stay in order: with a full queue berry waits for the
+ * worker rather than writing past older queued values.
+ * 32 bit data is passed as longs, as for XChangeProperty.
+ */
 static void
-client_raise(struct client *c)
+publish(Window w, Atom property, Atom type, int format, const void *data, int n)
 {
-    if (c != NULL) {
+    size_t size = n * (format == 8 ? 1 : format == 16 ? sizeof(short) : sizeof(long));
+    struct publish *p;
 
-        /* If the Client is set to be always below */
-        if (client_window_is_below(c))
-            return;
+    if (pub_display == NULL) {
+        XChangeProperty(display, w, property, type, format, PropModeReplace, data, n);
+        return;
+    }
 
-        if (!c->decorated) {
-            XRaiseWindow(display, c->window);
-        } else {
-            // how may active clients are there on our workspace
-            int count, i;
-            count = 0;
-            for (struct client *tmp = c_list[c->ws]; tmp != NULL; tmp = tmp->next) {
-                count++;
-            }
+    publish_reserve();
+    p = &pub_queue[pub_head & (PUBLISH_QUEUE_SIZE - 1)];
+    p->data = malloc(size ? size : 1);
+    if (p->data == NULL) {
+        XChangeProperty(display, w, property, type, format, PropModeReplace, data, n);
+        return;
+    }
+    memcpy(p->data, data, size);
+    p->window = w;
+    p->property = property;
+    p->type = type;
+    p->format = format;
+    p->n = n;
+    __atomic_store_n(&pub_head, pub_head + 1, __ATOMIC_RELEASE);
+    pub_queued = true;
+}
 
-            if (count == 0)
-                return;
+/* Wake the worker once per batch of events rather than per write */
+static void
+publish_wakeup(void)
+{
+    char c = 0;
+
+    pub_queued = false;
+    if (write(pub_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+        LOGN("Could not wake the publishing worker");
+}
+
+/* Wait until the queue has room for one more entry */
+static void
+publish_reserve(void)
+{
+    while (pub_head - __atomic_load_n(&pub_tail, __ATOMIC_ACQUIRE) == PUBLISH_QUEUE_SIZE) {
+        publish_wakeup();
+        sched_yield();
+    }
+}
 
-            Window wins[count*2];
+static void *
+publish_worker(void *arg)
+{
+    char buf[64];
+    UNUSED(arg);
+
+    for (;;) {
+        unsigned long head = __atomic_load_n(&pub_head, __ATOMIC_ACQUIRE);
 
-            i = 0;
-            for (struct client *tmp = c_list[c->ws]; tmp != NULL; tmp = tmp->next) {
-                wins[i] = tmp->window;
-                wins[i+1] = tmp->dec;
-                i += 2;
+        for (; pub_tail != head; ) {
+            struct publish *p = &pub_queue[pub_tail & (PUBLISH_QUEUE_SIZE - 1)];
+            if (p->window == None) {
+                XSync(pub_display, False);
+                return NULL;
             }
-            XRestackWindows(display, wins, count*2);
+            XChangeProperty(pub_display, p->window, p->property, p->type, p->format,
+                    PropModeReplace, p->data, p->n);
+            free(p->data);
+            __atomic_store_n(&pub_tail, pub_tail + 1, __ATOMIC_RELEASE);
         }
+        XFlush(pub_display);
+
+        if (read(pub_pipe[0], buf, sizeof buf) < 0 && errno != EINTR)
+            return NULL;
     }
 }
 
-static void monitors_setup(void)
+/* Open the worker's connection and start it. Without it every property is
+ * written by berry itself, as before.
+ */
+static void
+publish_start(void)
 {
-    XineramaScreenInfo *m_info;
-    int n;
-
-    if (!XineramaIsActive(display)) {
-        LOGN("Xinerama not active, cannot read monitors");
+    pub_display = XOpenDisplay(DisplayString(display));
+    if (pub_display == NULL) {
+        LOGN("Could not open a second connection, publishing inline");
         return;
     }
-
-    m_info = XineramaQueryScreens(display, &n);
-    if (m_info == NULL) {
-        LOGN("Xinerama could not query screens");
+    if (pipe(pub_pipe) < 0) {
+        LOGN("Could not create the worker pipe, publishing inline");
+        XCloseDisplay(pub_display);
+        pub_display = NULL;
         return;
     }
-    LOGP("Found %d screens active", n);
-    m_count = n;
+    fcntl(pub_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pub_pipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(pub_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(ConnectionNumber(pub_display), F_SETFD, FD_CLOEXEC);
+
+    if (pthread_create(&pub_thread, NULL, publish_worker, NULL) != 0) {
+        LOGN("Could not start the publishing worker, publishing inline");
+        close(pub_pipe[0]);
+        close(pub_pipe[1]);
+        XCloseDisplay(pub_display);
+        pub_display = NULL;
+    }
+}
 
-    /* First, we need to decide which monitors are unique.
-     * Non-unique monitors can become a problem when displays
-     * are mirrored. They will share the same information (which something
-     * like xrandr will handle for us) but will have the exact same information.
-     * We want to avoid creating duplicate structs for the same monitor if we dont
-     * need to
-     */
+/* Let the worker finish every queued write, then join it */
+static void
+publish_stop(void)
+{
+    if (pub_display == NULL)
+        return;
+
+    publish_reserve();
+    pub_queue[pub_head & (PUBLISH_QUEUE_SIZE - 1)].window = None;
+    __atomic_store_n(&pub_head, pub_head + 1, __ATOMIC_RELEASE);
+    publish_wakeup();
+    pthread_join(pub_thread, NULL);
+
+    close(pub_pipe[0]);
+    close(pub_pipe[1]);
+    XCloseDisplay(pub_display);
+    pub_display = NULL;
+    pub_head = pub_tail = 0;
+}
 
-    // TODO: Add support for repeated displays
+/* Listen on $XDG_RUNTIME_DIR/berry-$DISPLAY.sock so that berryc can send
+ * many commands over a single connection and receive a status for each.
+ * The ClientMessage protocol keeps working if this fails.
+ */
+static void
+ipc_socket_setup(void)
+{
+    struct sockaddr_un addr;
 
-    m_list = malloc(sizeof(struct monitor) * n);
+    for (int i = 0; i < IPC_MAX_CONNS; i++)
+        ipc_conns[i].fd = -1;
 
-    for (int i = 0; i < n; i++) {
-        m_list[i].screen = m_info[i].screen_number;
-        m_list[i].width = m_info[i].width;
-        m_list[i].height = m_info[i].height;
-        m_list[i].x = m_info[i].x_org;
-        m_list[i].y = m_info[i].y_org;
-        LOGP("Screen #%d with dim: x=%d y=%d w=%d h=%d",
-                m_list[i].screen, m_list[i].x, m_list[i].y, m_list[i].width, m_list[i].height);
+    if (ipc_socket_path(ipc_path, sizeof ipc_path, DisplayString(display)) < 0) {
+        LOGN("No runtime directory, socket IPC disabled");
+        return;
     }
 
-    ewmh_set_viewport();
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, ipc_path, sizeof(addr.sun_path) - 1);
+
+    ipc_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ipc_fd < 0) {
+        LOGN("Could not create IPC socket");
+        return;
+    }
+    fcntl(ipc_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(ipc_fd, F_SETFL, O_NONBLOCK);
+
+    unlink(ipc_path);
+    if (bind(ipc_fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(ipc_fd, IPC_MAX_CONNS) < 0) {
+        LOGP("Could not listen on %s, socket IPC disabled", ipc_path);
+        close(ipc_fd);
+        ipc_fd = -1;
+        return;
+    }
+    chmod(ipc_path, 0600);
+    reactor_ctl(EPOLL_CTL_ADD, ipc_fd, EPOLLIN, SourceIPC);
+    LOGP("Listening for IPC on %s", ipc_path);
 }
 
 static void
-client_refresh(struct client *c)
+ipc_socket_close(void)
 {
-    LOGN("Refreshing client");
-    for (int i = 0; i < 2; i++) {
-        client_move_relative(c, 0, 0);
-        client_resize_relative(c, 0, 0);
+    for (int i = 0; i < IPC_MAX_CONNS; i++)
+        if (ipc_conns[i].fd >= 0)
+            ipc_conn_close(&ipc_conns[i]);
+
+    if (ipc_fd >= 0) {
+        reactor_ctl(EPOLL_CTL_DEL, ipc_fd, 0, SourceIPC);
+        close(ipc_fd);
+        unlink(ipc_path);
+        ipc_fd = -1;
     }
 }
 
 static void
-refresh_config(void)
+ipc_socket_accept(void)
 {
-    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
-        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
-            /* We run into this annoying issue when where we have to
-             * re-create these windows since the border_width has changed.
-             * We end up destroying and recreating this windows, but this
-             * causes them to be redrawn on the wrong screen, regardless of
-             * their current desktop. The easiest way around this is to move
-             * them all to the current desktop and then back again */
-            if (tmp->decorated && conf.decorate) {
-                client_decorations_destroy(tmp);
-                client_decorations_create(tmp);
-                XMapWindow(display, tmp->dec);
-            }
+    int fd;
 
-            client_refresh(tmp);
-            client_show(tmp);
-
-            if (f_client != tmp)
-                client_set_color(tmp, conf.iu_color, conf.bu_color);
-            else
-                client_set_color(tmp, conf.if_color, conf.bf_color);
+    fd = accept(ipc_fd, NULL, NULL);
+    if (fd < 0)
+        return;
 
-            if (i != curr_ws) {
-                client_hide(tmp);
-            } else {
-                client_show(tmp);
-                client_raise(tmp);
-            }
+    for (int i = 0; i < IPC_MAX_CONNS; i++) {
+        if (ipc_conns[i].fd < 0) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            ipc_conns[i].fd = fd;
+            ipc_conns[i].len = 0;
+            strbuf_free(&ipc_conns[i].out);
+            ipc_conns[i].events = 0;
+            ipc_conns[i].watched = EPOLLIN;
+            reactor_ctl(EPOLL_CTL_ADD, fd, EPOLLIN, SourceConn + i);
+            return;
         }
     }
+
+    LOGN("Too many IPC connections, dropping new connection");
+    close(fd);
 }
 
 static void
-client_resize_absolute(struct client *c, int w, int h)
+ipc_conn_close(struct ipc_conn *conn)
 {
-    int dw = w;
-    int dh = h;
-    int dec_w = w;
-    int dec_h = h;
+    reactor_ctl(EPOLL_CTL_DEL, conn->fd, 0, SourceConn);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->len = 0;
+    conn->events = 0;
+    conn->watched = 0;
+    strbuf_free(&conn->out);
+}
 
-    if (c->decorated) {
-        dw = w - (2 * conf.i_width) - (2 * conf.b_width);
-        dh = h - (2 * conf.i_width) - (2 * conf.b_width) - conf.t_height;
+/* Write as much of the pending output as the socket takes without blocking,
+ * the rest is sent once epoll reports the connection writable again.
+ */
+static void
+ipc_conn_flush(struct ipc_conn *conn)
+{
+    ssize_t n;
 
-        dec_w = w - (2 * conf.b_width);
-        dec_h = h - (2 * conf.b_width);
+    while (conn->out.len > 0) {
+        n = send(conn->fd, conn->out.data, conn->out.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            ipc_conn_close(conn);
+            return;
+        }
+        memmove(conn->out.data, conn->out.data + n, conn->out.len - n);
+        conn->out.len -= n;
     }
+}
 
-    /*LOGN("Resizing client main window");*/
-    XResizeWindow(display, c->window, MAX(dw, MINIMUM_DIM), MAX(dh, MINIMUM_DIM));
-    if (c->decorated) {
-        /*LOGN("Resizing client decoration");*/
-        XResizeWindow(display, c->dec, MAX(dec_w, MINIMUM_DIM), MAX(dec_h, MINIMUM_DIM));
+/* Queue output for the connection. A connection which stops reading, be it
+ * a subscriber or a client pipelining commands, is dropped once more than
+ * IPC_EVENT_BACKLOG bytes are waiting, rather than letting it stall berry
+ * or grow without bound. A single larger reply still goes out whole.
+ */
+static void
+ipc_conn_queue(struct ipc_conn *conn, const void *data, size_t len)
+{
+    if (conn->out.len > IPC_EVENT_BACKLOG) {
+        LOGN("IPC connection is not reading, closing it");
+        ipc_conn_close(conn);
+        return;
     }
+    if (strbuf_append(&conn->out, data, len) < 0)
+        ipc_conn_close(conn);
+}
 
-    c->geom.width = MAX(w, MINIMUM_DIM);
-    c->geom.height = MAX(h, MINIMUM_DIM);
-    if (c->mono)
-        c->mono = false;
-    client_set_status(c);
+/* Start an event line for the given event, returns false if no connection
+ * subscribed to it so callers can skip serializing anything.
+ */
+static bool
+ipc_event_begin(int event, struct strbuf *sb)
+{
+    for (int i = 0; i < IPC_MAX_CONNS; i++) {
+        if (ipc_conns[i].fd >= 0 && ipc_conns[i].events & (1u << event)) {
+            strbuf_printf(sb, "{\"event\":\"%s\"", event_names[event]);
+            return true;
+        }
+    }
+    return false;
 }
 
+/* Terminate the event line and queue it for every subscriber. Events are
+ * written out with the next pass through the event loop.
+ */
 static void
-client_resize_relative(struct client *c, int w, int h)
+ipc_event_end(int event, struct strbuf *sb)
 {
-    if (conf.edge_lock) {
-        int dw, dh, mon;
-        mon = ws_m_list[c->ws];
+    strbuf_append(sb, "}\n", 2);
+    for (int i = 0; sb->data != NULL && i < IPC_MAX_CONNS; i++)
+        if (ipc_conns[i].fd >= 0 && ipc_conns[i].events & (1u << event))
+            ipc_conn_queue(&ipc_conns[i], sb->data, sb->len);
+    strbuf_free(sb);
+}
 
-        /* First, check if the resize will exceed the dimensions set by
-         * the right side of the given monitor. If they do, cap the resize
-         * amount to move only to the edge of the monitor.
-         */
-        if (c->geom.x + c->geom.width + w > m_list[mon].x + m_list[mon].width - conf.right_gap)
-            dw = m_list[mon].x + m_list[mon].width - c->geom.x - conf.right_gap;
-        else
-            dw = c->geom.width + w;
+static void
+ipc_event_client(int event, struct client *c)
+{
+    struct strbuf sb = { 0 };
 
-        /* Next, check if the resize will exceed the dimensions set by
-         * the bottom side of the given monitor. If they do, cap the resize
-         * amount to move only to the edge of the monitor.
-         */
-        if (c->geom.y + c->geom.height + conf.t_height + h > m_list[mon].y + m_list[mon].height - conf.bot_gap)
-            dh = m_list[mon].height + m_list[mon].y - c->geom.y - conf.bot_gap;
-        else
-            dh = c->geom.height + h;
+    if (!ipc_event_begin(event, &sb))
+        return;
 
-        client_resize_absolute(c, dw, dh);
-    } else {
-        client_resize_absolute(c, c->geom.width + w, c->geom.height + h);
-    }
+    strbuf_printf(&sb, ",\"window\":");
+    if (c != NULL)
+        query_client(c, &sb);
+    else
+        strbuf_printf(&sb, "null");
+    ipc_event_end(event, &sb);
 }
 
 static void
-run(void)
+ipc_event_workspace(int ws)
 {
-    XEvent e;
-    XSync(display, false);
-    while (running) {
-        XNextEvent(display, &e);
-        LOGP("Received new %d event", e.type);
-        if (event_handler[e.type]) {
-            LOGP("Handling %d event", e.type);
-            event_handler[e.type](&e);
+    struct strbuf sb = { 0 };
+
+    if (!ipc_event_begin(EventWorkspace, &sb))
+        return;
+
+    strbuf_printf(&sb, ",\"workspace\":%d,\"monitor\":%d", ws, ws_m_list[ws]);
+    ipc_event_end(EventWorkspace, &sb);
+}
+
+/* Report which setting changed, named as in berryc and berryrc */
+static void
+ipc_event_config(long *d)
+{
+    struct strbuf sb = { 0 };
+    bool config = d[0] == IPCConfig;
+
+    if (!ipc_event_begin(EventConfig, &sb))
+        return;
+
+    strbuf_printf(&sb, ",\"option\":\"%s\"", command_name(config ? d[1] : d[0], config));
+    ipc_event_end(EventConfig, &sb);
+}
+
+/* Read whatever is available on the connection and run every complete
+ * frame. Replies are held back until the X requests of the whole batch
+ * have been processed by the server, so an acknowledged command is visible
+ * to any X client by the time berryc sees its status.
+ */
+static void
+ipc_conn_read(struct ipc_conn *conn)
+{
+    struct strbuf payload = { 0 };
+    struct ipc_frame frame;
+    struct ipc_reply reply;
+    char str[IPC_STRING_MAX + 1];
+    long d[5];
+    size_t off = 0;
+    ssize_t n;
+    int replies = 0;
+
+    n = recv(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        ipc_conn_close(conn);
+        return;
+    }
+    conn->len += n;
+
+    while (conn->len - off >= sizeof frame) {
+        memcpy(&frame, conn->buf + off, sizeof frame);
+        if (frame.length > IPC_STRING_MAX) {
+            LOGN("IPC frame too large, closing connection");
+            ipc_conn_close(conn);
+            return;
+        }
+        if (conn->len - off < sizeof frame + frame.length)
+            break;
+
+        memcpy(str, conn->buf + off + sizeof frame, frame.length);
+        str[frame.length] = '\0';
+        for (int i = 0; i < 5; i++)
+            d[i] = frame.data[i];
+
+        if (d[0] == IPCSubscribe) {
+            reply.status = d[1] < 0 || d[1] >= 1 << EventLast ? IPCBadArgument : IPCSuccess;
+            if (reply.status == IPCSuccess)
+                conn->events = d[1] ? (unsigned int)d[1] : (1u << EventLast) - 1;
+        } else {
+            reply.status = ipc_command(d, frame.length ? str : NULL, &payload);
+        }
+        /* Events caused by the command may have dropped the connection */
+        if (conn->fd >= 0) {
+            reply.length = payload.len;
+            ipc_conn_queue(conn, &reply, sizeof reply);
         }
+        if (conn->fd >= 0 && payload.len > 0)
+            ipc_conn_queue(conn, payload.data, payload.len);
+        strbuf_free(&payload);
+        if (conn->fd < 0)
+            return;
+        off += sizeof frame + frame.length;
+        replies++;
+    }
+
+    memmove(conn->buf, conn->buf + off, conn->len - off);
+    conn->len -= off;
+
+    if (replies > 0) {
+        if (config_dirty)
+            refresh_config();
+        XSync(display, False);
+        ipc_conn_flush(conn);
     }
 }
 
@@ -1970,13 +4976,14 @@ static void
 client_save(struct client *c, int ws)
 {
     /* Save the client to the "stack" of managed clients */
-    c->next = c_list[ws];
-    c_list[ws] = c;
+    c->ws = ws;
+    client_stack_insert(c);
 
     /* Save the client o the list of focusing order */
     c->f_next = f_list[ws];
     f_list[ws] = c;
 
+    edges_touch(c);
     ewmh_set_client_list();
 }
 
@@ -2021,6 +5028,8 @@ client_send_to_ws(struct client *c, int ws)
         client_hide(c);
 
     ewmh_set_desktop(c, ws);
+    layout_changed(prev);
+    layout_changed(ws);
 }
 
 static void
@@ -2049,24 +5058,65 @@ client_set_title(struct client *c)
     int count;
 
     c->title[0] = 0;
+    stats.round_trips[StatGetWindowProperty]++;
     if (!XGetTextProperty(display, c->window, &tp, net_atom[NetWMName])) {
         LOGN("Could not read client title, not updating");
         return;
     }
 
-    if (tp.encoding == XA_STRING) {
-        strncpy(c->title, (char *)tp.value, sizeof(c->title) - 1);
-    } else {
-        if (XmbTextPropertyToTextList(display, &tp, &slist, &count) >= Success && count > 0 && *slist) {
-            strncpy(c->title, slist[0], sizeof(c->title) - 1);
-            XFreeStringList(slist);
-        }
+    /* UTF8_STRING is used as is. STRING is Latin-1 and COMPOUND_TEXT
+     * is worse, both are converted to the UTF-8 Xft draws.
+     */
+    if (tp.encoding == utf8string) {
+        utf8_copy(c->title, (char *)tp.value, sizeof c->title);
+    } else if (Xutf8TextPropertyToTextList(display, &tp, &slist, &count) >= Success && count > 0 && *slist) {
+        utf8_copy(c->title, slist[0], sizeof c->title);
     }
 
-    c->title[sizeof c->title - 1] = 0;
+    if (slist)
+        XFreeStringList(slist);
     XFree(tp.value);
 }
 
+static void
+client_title_refresh(struct client *c, unsigned long now)
+{
+    LOGN("Updating client title");
+    c->title_dirty = false;
+    c->title_time = now;
+    client_set_title(c);
+    draw_text(c, c == f_client);
+}
+
+/* Fetch and redraw every visible title marked dirty during the last batch,
+ * at most once per title_interval ms per client. Returns the number of ms
+ * until a held back title is due, or -1 if there is none.
+ */
+static int
+titles_refresh(void)
+{
+    unsigned long now = record_now() / 1000;
+    int timeout = -1;
+
+    titles_dirty = false;
+    for (int i = 0; i < WORKSPACE_NUMBER; i++) {
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next) {
+            if (!tmp->title_dirty || tmp->hidden)
+                continue;
+            if (conf.title_interval > 0 && now - tmp->title_time < (unsigned long)conf.title_interval) {
+                int left = conf.title_interval - (now - tmp->title_time);
+                if (timeout < 0 || left < timeout)
+                    timeout = left;
+                titles_dirty = true;
+                continue;
+            }
+            client_title_refresh(tmp, now);
+        }
+    }
+
+    return timeout;
+}
+
 
 static void
 setup(void)
@@ -2086,6 +5136,8 @@ setup(void)
     conf.r_step           = RESIZE_STEP;
     conf.focus_new        = FOCUS_NEW;
     conf.edge_lock        = EDGE_LOCK;
+    conf.edge_snap        = EDGE_SNAP;
+    conf.snap_distance    = SNAP_DISTANCE;
     conf.t_center         = TITLE_CENTER;
     conf.top_gap          = TOP_GAP;
     conf.bot_gap          = BOT_GAP;
@@ -2107,9 +5159,13 @@ setup(void)
     conf.fs_remove_dec    = FULLSCREEN_REMOVE_DEC;
     conf.fs_max           = FULLSCREEN_MAX;
     conf.pointer_interval = POINTER_INTERVAL;
+    conf.status_interval  = STATUS_INTERVAL;
+    conf.title_interval   = TITLE_INTERVAL;
+    conf.slow_threshold   = SLOW_THRESHOLD;
     conf.follow_pointer   = FOLLOW_POINTER;
     conf.focus_on_click   = FOCUS_ON_CLICK;
     conf.warp_pointer     = WARP_POINTER;
+    conf.auto_layout      = AUTO_LAYOUT;
 
     root = DefaultRootWindow(display);
     screen = DefaultScreen(display);
@@ -2119,8 +5175,7 @@ setup(void)
     normal_cursor = XCreateFontCursor(display, XC_left_ptr);
     XDefineCursor(display, root, normal_cursor);
 
-    XSelectInput(display, root,
-            StructureNotifyMask|SubstructureRedirectMask|SubstructureNotifyMask|ButtonPressMask|Button1Mask);
+    XSelectInput(display, root, ROOT_MASK);
     xerrorxlib = XSetErrorHandler(xerror);
 
     check = XCreateSimpleWindow(display, root, 0, 0, 1, 1, 0, 0, 0);
@@ -2136,6 +5191,7 @@ setup(void)
     net_atom[NetActiveWindow]        = XInternAtom(display, "_NET_ACTIVE_WINDOW", False);
     net_atom[NetWMStateFullscreen]   = XInternAtom(display, "_NET_WM_STATE_FULLSCREEN", False);
     net_atom[NetWMStateBelow]        = XInternAtom(display, "_NET_WM_STATE_BELOW", False);
+    net_atom[NetWMStateAbove]        = XInternAtom(display, "_NET_WM_STATE_ABOVE", False);
     net_atom[NetWMMoveResize]        = XInternAtom(display, "_NET_MOVERESIZE_WINDOW", False);
     net_atom[NetWMCheck]             = XInternAtom(display, "_NET_SUPPORTING_WM_CHECK", False);
     net_atom[NetCurrentDesktop]      = XInternAtom(display, "_NET_CURRENT_DESKTOP", False);
@@ -2164,6 +5220,8 @@ setup(void)
     net_berry[BerryWindowStatus]     = XInternAtom(display, "BERRY_WINDOW_STATUS", False);
     net_berry[BerryClientEvent]      = XInternAtom(display, "BERRY_CLIENT_EVENT", False);
     net_berry[BerryFontProperty]     = XInternAtom(display, "BERRY_FONT_PROPERTY", False);
+    net_berry[BerryStats]            = XInternAtom(display, BERRY_STATS, False);
+    net_berry[BerryQueryReply]       = XInternAtom(display, BERRY_QUERY_REPLY, False);
 
     LOGN("Successfully assigned atoms");
 
@@ -2182,12 +5240,14 @@ setup(void)
     data2[0] = curr_ws;
     XChangeProperty(display, root, net_atom[NetCurrentDesktop], XA_CARDINAL, 32, PropModeReplace, (unsigned char *) data2, 1);
     LOGN("Setting up monitors");
-    monitors_setup();
+    randr_setup();
+    monitors_update();
     LOGN("Successfully setup monitors");
     mon = ws_m_list[curr_ws];
-    XWarpPointer(display, None, root, 0, 0, 0, 0,
-        m_list[mon].x + m_list[mon].width / 2,
-        m_list[mon].y + m_list[mon].height / 2);
+    if (restore_fd < 0)
+        XWarpPointer(display, None, root, 0, 0, 0, 0,
+            m_list[mon].x + m_list[mon].width / 2,
+            m_list[mon].y + m_list[mon].height / 2);
 
     gc = XCreateGC(display, root, 0, 0);
 
@@ -2197,8 +5257,11 @@ setup(void)
     XftColorAllocName(display, DefaultVisual(display, screen), DefaultColormap(display, screen),
             TEXT_UNFOCUS_COLOR, &xft_unfocus_color);
 
-    font = XftFontOpenName(display, screen, global_font);
+    font = font_acquire(global_font);
     ewmh_set_desktop_names();
+    reactor_setup();
+    ipc_socket_setup();
+    publish_start();
 }
 
 static void
@@ -2209,6 +5272,9 @@ client_show(struct client *c)
         client_move_absolute(c, c->x_hide, c->geom.y);
         client_raise(c);
         c->hidden = false;
+        /* Titles of hidden clients are only fetched once they are shown */
+        if (c->title_dirty)
+            client_title_refresh(c, record_now() / 1000);
     }
 }
 
@@ -2265,6 +5331,8 @@ switch_ws(int ws)
         }
     }
     curr_ws = ws;
+    if (layout_pending[ws])
+        layout_apply(ws);
     int mon = ws_m_list[ws];
     LOGP("Setting Screen #%d with active workspace %d", m_list[mon].screen, ws);
     client_manage_focus(c_list[curr_ws]);
@@ -2292,42 +5360,36 @@ client_toggle_decorations(struct client *c)
     client_raise(c);
     client_manage_focus(c);
     ewmh_set_frame_extents(c);
+    ipc_event_client(EventState, c);
 }
 
-/*
- * Credit to tudurom and windowchef
- * as inspiration for this functionality
+/* Publish the state of the client in BERRY_WINDOW_STATUS on its window.
+ * The status is formatted into a stack buffer and only written when it
+ * differs from the last published value. While the client is dragged
+ * with the mouse, writes are limited to one per status_interval and the
+ * final state is published on ButtonRelease.
+ * Credit to tudurom and windowchef as inspiration for this functionality.
  */
 static void
 client_set_status(struct client *c)
 {
     if (c == NULL)
         return;
+    char str[STATUS_MAX];
     int size = 0;
     int mon = 0;
-    char *str = NULL;
-    char *state, *decorated;
-
-    LOGN("Updating client status...");
+    const char *state, *decorated;
 
-    if (c->fullscreen)
-        state = "fullscreen";
-    else if (c->mono)
-        state = "mono";
-    else if (c->hidden)
-        state = "hidden";
-    else
-        state = "normal";
+    state = client_state(c);
 
     if (c->decorated)
         decorated = "true";
     else
         decorated = "false";
 
-
+    mon = ws_m_list[c->ws];
     if (conf.json_status) {
-        mon = ws_m_list[c->ws];
-        size = asprintf(&str,
+        size = snprintf(str, sizeof str,
                 "{"
                     "\"window\":\"0x%08x\","
                     "\"geom\":{"
@@ -2350,7 +5412,7 @@ client_set_status(struct client *c)
                 mon, m_list[mon].x, m_list[mon].y, m_list[mon].width, m_list[mon].height,
                 state, decorated);
     } else {
-        size = asprintf(&str,
+        size = snprintf(str, sizeof str,
                 "0x%08x, " // window id
                 "%d, " // x
                 "%d, " // y
@@ -2367,14 +5429,35 @@ client_set_status(struct client *c)
                 mon, m_list[mon].x, m_list[mon].y, m_list[mon].width, m_list[mon].height);
     }
 
-    if (size == -1) {
-        LOGN("asprintf returned -1, could not report window status");
+    if (size < 0 || size >= (int)sizeof str) {
+        LOGN("Could not format window status");
         return;
     }
 
-    XChangeProperty(display, c->window, net_berry[BerryWindowStatus], utf8string, 8, PropModeReplace,
-            (unsigned char *) str, strlen(str));
-    free(str);
+    if (strcmp(str, c->status) == 0)
+        return;
+
+    if (c == drag.client && conf.status_interval > 0 &&
+            drag.time - c->status_time < (Time)conf.status_interval)
+        return;
+
+    LOGN("Updating client status...");
+    memcpy(c->status, str, size + 1);
+    c->status_time = drag.time;
+    publish(c->window, net_berry[BerryWindowStatus], utf8string, 8, str, size);
+}
+
+static const char *
+client_state(struct client *c)
+{
+    if (c->fullscreen)
+        return "fullscreen";
+    else if (c->mono)
+        return "mono";
+    else if (c->hidden)
+        return "hidden";
+    else
+        return "normal";
 }
 
 static void
@@ -2385,17 +5468,20 @@ client_set_wm_state(struct client *c, unsigned long state)
 }
 
 static void
-ewmh_set_fullscreen(struct client *c, bool fullscreen)
+ewmh_set_state(struct client *c)
 {
-    XChangeProperty(display, c->window, net_atom[NetWMState], XA_ATOM, 32,
-            PropModeReplace, (unsigned char *)&net_atom[NetWMStateFullscreen], fullscreen ? 1 : 0 );
-}
+    Atom states[2];
+    int n = 0;
+
+    if (c->fullscreen)
+        states[n++] = net_atom[NetWMStateFullscreen];
+    if (c->layer == LayerBelow)
+        states[n++] = net_atom[NetWMStateBelow];
+    else if (c->layer == LayerAbove)
+        states[n++] = net_atom[NetWMStateAbove];
 
-static void
-ewmh_set_below(struct client *c, bool below)
-{
     XChangeProperty(display, c->window, net_atom[NetWMState], XA_ATOM, 32,
-            PropModeReplace, (unsigned char *)&net_atom[NetWMStateBelow], below ? 1 : 0 );
+            PropModeReplace, (unsigned char *)states, n);
 }
 
 static void
@@ -2412,6 +5498,7 @@ ewmh_set_focus(struct client *c)
         f_client = c;
         /* Tell EWMH about our new window */
         XChangeProperty(display, root, net_atom[NetActiveWindow], XA_WINDOW, 32, PropModeReplace, (unsigned char *) &(c->window), 1);
+        ipc_event_client(EventFocus, c);
 }
 
 static void
@@ -2446,12 +5533,19 @@ static void ewmh_set_frame_extents(struct client *c)
 
 static void ewmh_set_client_list(void)
 {
-    /* Remove all current clients */
-    XDeleteProperty(display, root, net_atom[NetClientList]);
+    int n = 0;
+
+    for (int i = 0; i < WORKSPACE_NUMBER; i++)
+        for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
+            n++;
+
+    long windows[n + 1];
+    n = 0;
     for (int i = 0; i < WORKSPACE_NUMBER; i++)
         for (struct client *tmp = c_list[i]; tmp != NULL; tmp = tmp->next)
-            XChangeProperty(display, root, net_atom[NetClientList], XA_WINDOW, 32, PropModeAppend,
-                    (unsigned char *) &(tmp->window), 1);
+            windows[n++] = tmp->window;
+
+    publish(root, net_atom[NetClientList], XA_WINDOW, 32, windows, n);
 }
 
 /*
@@ -2481,12 +5575,13 @@ ewmh_set_active_desktop(int ws)
     data[0] = ws;
     XChangeProperty(display, root, net_atom[NetCurrentDesktop], XA_CARDINAL, 32,
             PropModeReplace, (unsigned char *) data, 1);
+    ipc_event_workspace(ws);
 }
 
 static void
 usage(void)
 {
-    printf("Usage: berry [-h|-v|-c CONFIG_PATH]\n");
+    printf("Usage: berry [-h|-v|-c CONFIG_PATH|-s SETTINGS_PATH]\n");
     exit(EXIT_SUCCESS);
 }
 
@@ -2502,6 +5597,13 @@ version(void)
 static int
 xerror(Display *dpy, XErrorEvent *e)
 {
+    /* The worker only writes properties, of windows which may be gone */
+    if (dpy == pub_display)
+        return 0;
+
+    if (e->request_code == X_GrabKey && e->error_code == BadAccess)
+        grab_failed = true;
+
     /* this is stolen verbatim from katriawm which stole it from dwm lol */
     if (e->error_code == BadWindow ||
             (e->request_code == X_SetInputFocus && e->error_code == BadMatch) ||
@@ -2616,11 +5718,14 @@ main(int argc, char *argv[])
     int opt;
     char *conf_path = malloc(MAXLEN * sizeof(char));
     char *font_name = malloc(MAXLEN * sizeof(char));
-    bool conf_found = true;
+    char *settings_path = malloc(MAXLEN * sizeof(char));
+    bool conf_found = true, settings_found = true;
     conf_path[0] = '\0';
     font_name[0] = '\0';
+    settings_path[0] = '\0';
 
-    while ((opt = getopt(argc, argv, "dhf:vc:")) != -1) {
+    berry_argv = argv;
+    while ((opt = getopt(argc, argv, "dhf:vc:s:R:")) != -1) {
         switch (opt) {
             case 'h':
                 usage();
@@ -2631,11 +5736,20 @@ main(int argc, char *argv[])
             case 'c':
                 snprintf(conf_path, MAXLEN * sizeof(char), "%s", optarg);
                 break;
+            case 's':
+                snprintf(settings_path, MAXLEN * sizeof(char), "%s", optarg);
+                break;
             case 'v':
                 version();
                 break;
             case 'd':
                 debug = true;
+#ifdef NDEBUG
+                fprintf(stderr, "%s: built without debug logging, reconfigure with --with-debug\n", __WINDOW_MANAGER_NAME__);
+#endif
+                break;
+            case 'R':
+                restore_fd = strtol(optarg, NULL, 10);
                 break;
         }
     }
@@ -2655,6 +5769,18 @@ main(int argc, char *argv[])
         }
     }
 
+    if (settings_path[0] == '\0') {
+        char *xdg_home = getenv("XDG_CONFIG_HOME");
+        if (xdg_home != NULL) {
+            snprintf(settings_path, MAXLEN * sizeof(char), "%s/%s", xdg_home, BERRY_SETTINGS);
+        } else {
+            char *home = getenv("HOME");
+            if (home == NULL)
+                settings_found = false;
+            snprintf(settings_path, MAXLEN * sizeof(char), "%s/%s/%s", home, ".config", BERRY_SETTINGS);
+        }
+    }
+
     if (font_name[0] == '\0') { // font not loaded
         LOGN("font not specified, loading default font");
     } else {
@@ -2662,6 +5788,10 @@ main(int argc, char *argv[])
         strncpy(global_font, font_name, sizeof(global_font));
     }
 
+    /* The publishing worker uses a connection of its own, Xlib still
+     * needs to know that there are threads
+     */
+    XInitThreads();
     display = XOpenDisplay(NULL);
     if (!display)
         exit(EXIT_FAILURE);
@@ -2669,12 +5799,33 @@ main(int argc, char *argv[])
     LOGN("Successfully opened display");
 
     setup();
-    if (conf_found) {
+    if (restore_fd < 0 || !state_restore(restore_fd)) {
+        if (settings_found)
+            load_settings(settings_path);
+    }
+    /* Drop the frames and everything else of the instance we restarted
+     * from, which were retained so that no window showed up bare. This
+     * has to be done before the scan, which would adopt the old frames.
+     */
+    if (restore_fd >= 0) {
+        XKillClient(display, AllTemporary);
+        XSync(display, False);
+    }
+    manage_existing_windows();
+    if (conf_found && restore_fd < 0) {
         signal(SIGCHLD, SIG_IGN);
         load_config(conf_path);
     }
-    run();
+    for (;;) {
+        run();
+        if (!restarting)
+            break;
+        restart();
+        restarting = false;
+        running = true;
+    }
     close_wm();
     free(font_name);
     free(conf_path);
+    free(settings_path);
 }